@@ -0,0 +1,66 @@
+#ifndef SCRIBBLE_ATOM
+#define SCRIBBLE_ATOM
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+/*
+ * The id of an interned symbol or string. Ids are handed out in the order
+ * names are first seen and never reused, so tables keyed by name may be
+ * indexed by atom and two names are equal exactly when their atoms are.
+ */
+typedef uint32_t Atom;
+
+/*
+ * Every name the process has seen, kept once for as long as it runs. Names
+ * never move, so values may point straight at them. The index from names to
+ * atoms refers to the names rather than copying them.
+ */
+class Atoms
+{
+public:
+    /* The atom for `name`, interning it if it is new */
+    static Atom
+    intern (const std::string& name)
+    {
+        Atoms& atoms = table();
+        auto iter = atoms.ids.find(std::cref(name));
+        if (iter != atoms.ids.end())
+            return iter->second;
+
+        Atom atom = atoms.names.size();
+        atoms.names.push_back(name);
+        atoms.ids.emplace(std::cref(atoms.names.back()), atom);
+        return atom;
+    }
+
+    static const std::string&
+    name (Atom atom)
+    {
+        return table().names[atom];
+    }
+
+    /* The number of atoms, which is one more than the latest */
+    static unsigned long
+    size ()
+    {
+        return table().names.size();
+    }
+
+protected:
+    std::deque<std::string> names;
+    std::unordered_map<std::reference_wrapper<const std::string>, Atom,
+        std::hash<std::string>, std::equal_to<std::string>> ids;
+
+    static Atoms&
+    table ()
+    {
+        static Atoms atoms;
+        return atoms;
+    }
+};
+
+#endif
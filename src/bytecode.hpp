@@ -1,68 +1,96 @@
 #ifndef SCRIBBLE_BYTECODE
 #define SCRIBBLE_BYTECODE
 
+#include <cstdint>
+#include <cstdio>
+#include <vector>
 #include "definitions.hpp"
 #include "primitive.hpp"
 
+/*
+ * A fixed-size, 16 byte instruction. The meaning of the operand depends on
+ * the operator: an immediate integer for OP_MOVEINT, a relative stack index
+ * for the OP_LOAD* family, and an index into the constant pool for anything
+ * which needs a string (see `usesConstant`).
+ */
 struct Bytecode
 {
     Operator op;
     Register reg1;
     Register reg2;
-    Primitive primitive;
+    uint64_t operand;
 
     Bytecode ()
         : op(OP_NULL)
         , reg1(REG1)
         , reg2(REG2)
-        , primitive(Primitive())
+        , operand(0)
     {}
 
-    Bytecode (Operator op, Register r1, Register r2, Primitive primitive)
+    Bytecode (Operator op, Register r1, Register r2, uint64_t operand)
         : op(op)
         , reg1(r1)
         , reg2(r2)
-        , primitive(primitive)
+        , operand(operand)
     {}
 
-    Bytecode (Operator op, Register r1, Primitive primitive)
+    Bytecode (Operator op, Register r1, uint64_t operand)
         : op(op)
         , reg1(r1)
         , reg2(REGNULL)
-        , primitive(primitive)
+        , operand(operand)
     {}
 
     Bytecode (Operator op, Register r1)
         : op(op)
         , reg1(r1)
         , reg2(REGNULL)
-        , primitive(Primitive())
+        , operand(0)
     {}
 
-    Bytecode (Operator op, Primitive primitive)
+    Bytecode (Operator op, uint64_t operand)
         : op(op)
         , reg1(REGNULL)
         , reg2(REGNULL)
-        , primitive(primitive)
+        , operand(operand)
     {}
 
     Bytecode (Operator op)
         : op(op)
         , reg1(REGNULL)
         , reg2(REGNULL)
-        , primitive(Primitive())
+        , operand(0)
     {}
 
     void
-    print ()
+    print (const std::vector<Primitive>& constants) const
     {
-        std::cout << operatorString(op);
-        std::cout << "(";
-        std::cout << registerString(reg1);
-        std::cout << " " << registerString(reg2);
-        std::cout << " " << primitive.toString();
-        std::cout << ")\n";
+        printf("%s(%s %s ", operatorString(op).c_str(),
+                registerString(reg1).c_str(), registerString(reg2).c_str());
+        if (usesConstant(op))
+            printf("%s", constants[operand].toString().c_str());
+        else
+            printf("%ld", (long) operand);
+        printf(")\n");
+    }
+
+    /* Whether the operand of `op` is an index into the constant pool */
+    static bool
+    usesConstant (Operator op)
+    {
+        switch (op) {
+            case OP_MOVESTR:
+            case OP_MOVESYM:
+            case OP_PUSHCONST:
+            case OP_CALL:
+            case OP_TAILCALL:
+                return true;
+            default:
+                return false;
+        }
     }
 };
 
+static_assert(sizeof(Bytecode) == 16, "Bytecode should stay 16 bytes");
+
 #endif
@@ -0,0 +1,165 @@
+#ifndef SCRIBBLE_CODE
+#define SCRIBBLE_CODE
+
+#include <vector>
+#include <utility>
+#include <initializer_list>
+#include "bytecode.hpp"
+#include "primitive.hpp"
+
+/*
+ * A value computed at compile time for the instructions from a FOLD up to
+ * (not including) `end`, valid until a procedure in `deps` is redefined.
+ */
+struct Fold
+{
+    unsigned long end;
+    Primitive value;
+    std::vector<unsigned long> deps;
+};
+
+/*
+ * A contiguous buffer of instructions for a single procedure and the pool of
+ * constants its instructions refer to. The compiler emits straight into this
+ * buffer and the Machine copies it into its code area when the procedure is
+ * defined.
+ */
+class Code
+{
+public:
+    Code ()
+    {}
+
+    Code (std::initializer_list<Bytecode> instructions)
+        : _instructions(instructions)
+    {}
+
+    /* Append an instruction to the end of the buffer */
+    void
+    emit (Bytecode bc)
+    {
+        _instructions.push_back(bc);
+    }
+
+    /* Emit a call, noting that it was given `argc` arguments */
+    void
+    emitCall (Bytecode bc, unsigned long argc)
+    {
+        _calls.push_back(std::make_pair(_instructions.size(), argc));
+        emit(bc);
+    }
+
+    /*
+     * Emit `bc` in place of a call to the procedure named by the symbol at
+     * `constant`. The Machine turns it back into a call if that procedure is
+     * ever redefined.
+     */
+    void
+    emitInline (Bytecode bc, uint64_t constant)
+    {
+        _inlined.push_back(std::make_pair(_instructions.size(), constant));
+        emit(bc);
+    }
+
+    /*
+     * Guard the instructions from `start` to the end of the buffer with a
+     * FOLD which pushes `value` and skips them for as long as none of the
+     * procedures in `deps` are redefined.
+     */
+    void
+    fold (unsigned long start, Primitive value, std::vector<unsigned long> deps)
+    {
+        std::vector<Bytecode> instructions(_instructions);
+        std::vector<unsigned long> moved(_instructions.size() + 1);
+
+        for (unsigned long i = 0; i < moved.size(); i++)
+            moved[i] = i < start ? i : i + 1;
+        instructions.insert(instructions.begin() + start,
+                Bytecode(OP_FOLD, _folds.size()));
+
+        replace(instructions, moved);
+        _folds.push_back(Fold { _instructions.size(), value, deps });
+    }
+
+    /* The last instruction emitted */
+    Bytecode&
+    last ()
+    {
+        return _instructions.back();
+    }
+
+    /* Add a constant to the pool and return its index to use as an operand */
+    uint64_t
+    constant (Primitive primitive)
+    {
+        _constants.push_back(primitive);
+        return _constants.size() - 1;
+    }
+
+    unsigned long
+    size () const
+    {
+        return _instructions.size();
+    }
+
+    const std::vector<Bytecode>&
+    instructions () const
+    {
+        return _instructions;
+    }
+
+    const std::vector<Primitive>&
+    constants () const
+    {
+        return _constants;
+    }
+
+    /*
+     * Replace all instructions with `instructions`. The instruction which
+     * was at index `i` is now at `moved[i]`, which keeps inline and call
+     * records and the ends of folds pointing at the right place. `moved` has one more
+     * entry than there were instructions, for the end of the buffer.
+     */
+    void
+    replace (std::vector<Bytecode> instructions,
+             const std::vector<unsigned long>& moved)
+    {
+        _instructions = instructions;
+        for (auto& inlined : _inlined)
+            inlined.first = moved[inlined.first];
+        for (auto& fold : _folds)
+            fold.end = moved[fold.end];
+        for (auto& call : _calls)
+            call.first = moved[call.first];
+    }
+
+    /* Pairs of instruction index and the number of arguments of each call */
+    const std::vector<std::pair<unsigned long, unsigned long>>&
+    calls () const
+    {
+        return _calls;
+    }
+
+    /* Pairs of instruction index and the symbol of the call it replaced */
+    const std::vector<std::pair<unsigned long, uint64_t>>&
+    inlined () const
+    {
+        return _inlined;
+    }
+
+    /* Folds, indexed by the operand of each FOLD */
+    const std::vector<Fold>&
+    folds () const
+    {
+        return _folds;
+    }
+
+protected:
+    std::vector<Bytecode> _instructions;
+    std::vector<Primitive> _constants;
+    std::vector<std::pair<unsigned long, uint64_t>> _inlined;
+    std::vector<Fold> _folds;
+    std::vector<std::pair<unsigned long, unsigned long>> _calls;
+};
+
+#endif
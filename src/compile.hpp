@@ -2,17 +2,31 @@
 #define SCRIBBLE_COMPILE
 
 #include <vector>
+#include <queue>
 #include <cassert>
 #include "token.hpp"
-#include "bytecode.hpp"
+#include "code.hpp"
 #include "machine.hpp"
+#include "peephole.hpp"
 #include "frame.hpp"
 
 typedef enum {
     RSRV_NULL = 0,
     RSRV_DEFINE,
+    RSRV_DEFINE_PURE,
 } ReservedSymbol;
 
+/*
+ * What the compiler knows about the value an expression leaves on the stack:
+ * if `known`, it is `value` until a procedure in `deps` is redefined.
+ */
+struct Folded
+{
+    bool known;
+    Primitive value;
+    std::vector<unsigned long> deps;
+};
+
 class Compile
 {
 public:
@@ -20,20 +34,44 @@ public:
         : _machine(machine)
     {}
 
-    std::queue<Bytecode>
+    Code
     tokens (std::queue<Token> tokens)
     {
-        std::queue<Bytecode> bc;
+        Code bc;
         _tokens = tokens;
         expr(bc);
-        bc.push(Bytecode(OP_HALT));
+        bc.emit(Bytecode(OP_HALT));
+        optimize(REPL_SYMBOL, bc);
         return bc;
     }
 
+    /* Turn the peephole pass over compiled procedures on or off */
+    void
+    setPeephole (bool enabled)
+    {
+        _peephole.setEnabled(enabled);
+    }
+
 protected:
     Machine& _machine;
+    Peephole _peephole;
+    Frame _frame;
     std::queue<Token> _tokens;
 
+    /*
+     * Run the peephole pass over `code` and, if the Machine is verbose,
+     * report what it saved.
+     */
+    void
+    optimize (std::string name, Code &code)
+    {
+        unsigned long before = code.size();
+        unsigned long saved = _peephole.optimize(code);
+        if (_peephole.enabled() && _machine.isVerbose())
+            printf(REPL_INFO_STR "Peephole saved %lu of %lu in `%s'\n",
+                    saved, before, name.c_str());
+    }
+
     Token
     peek ()
     {
@@ -69,8 +107,8 @@ protected:
 
 private:
     /* literal = <string> | <integer> | <symbol> */
-    void
-    literal (std::queue<Bytecode> &bc, Token &token)
+    Folded
+    literal (Code &bc, Token &token)
     {
         Register reg = REG1;
         Operator op;
@@ -92,24 +130,33 @@ private:
 
             default:
                 fatal("Non-literal token encountered: `%s`!",
-                        token.str.c_str());
+                        token.text().c_str());
         }
-        bc.push(Bytecode(op, reg, token.toPrimitive()));
-        bc.push(Bytecode(OP_PUSH, reg));
+        if (op == OP_MOVEINT)
+            bc.emit(Bytecode(op, reg, token.toPrimitive().integer()));
+        else
+            bc.emit(Bytecode(op, reg, bc.constant(token.toPrimitive())));
+        bc.emit(Bytecode(OP_PUSH, reg));
+        return Folded { true, token.toPrimitive(), {} };
     }
 
     /*
      * <define> := <symbol>(<symbol> ([<symbol>]*) [<expr>]*)
      *
      * Compile to a custom, local set of Bytecode and then define it as a
-     * procedure. Push the name of that procedure as the return value.
+     * procedure. Push the name of that procedure as the return value. A call
+     * ending the body is a tail call. The body is compiled in a Frame of its
+     * arguments, which shadows that of any procedure it is defined in.
+     *
+     * Procedures defined with define-pure promise to have no side effects,
+     * so calls to them with constant arguments are folded.
      */
-    void
-    define (std::queue<Bytecode> &bc)
+    Folded
+    define (Code &bc, bool pure)
     {
         Token name;
         std::vector<Token> args;
-        std::queue<Bytecode> body;
+        Code body;
 
         expect(TKN_LPAREN);
         name = expect(TKN_SYMBOL);
@@ -119,82 +166,175 @@ private:
             args.push_back(expect(TKN_SYMBOL));
         expect(TKN_RPAREN);
 
+        Frame outer = _frame;
+        _frame = Frame(args);
         while (peek().type != TKN_RPAREN)
             expr(body);
         expect(TKN_RPAREN);
+        _frame = outer;
 
-        body.push(Bytecode(OP_RET));
-        _machine.defineProcedure(name.str.c_str(), args.size(), body);
+        if (body.size() > 0 && body.last().op == OP_CALL)
+            body.last().op = OP_TAILCALL;
+        body.emit(Bytecode(OP_RET));
+        optimize(Atoms::name(name.atom), body);
+        _machine.defineProcedure(Atoms::name(name.atom), args.size(), body,
+                pure);
 
-        literal(bc, name);
+        return literal(bc, name);
     }
 
-    void
-    reserved (std::queue<Bytecode> &bc, ReservedSymbol &symbol)
+    Folded
+    reserved (Code &bc, ReservedSymbol &symbol)
     {
         switch (symbol) {
-            case RSRV_DEFINE: define(bc); break;
+            case RSRV_DEFINE:      return define(bc, false);
+            case RSRV_DEFINE_PURE: return define(bc, true);
             default:
                 fatal("Unimplemented or erroneous ReservedSymbol");
         }
+        return Folded { false, Primitive(), {} };
     }
 
     bool
     isReserved (Token &token, ReservedSymbol &symbol)
     {
-        if (token.str == "define") {
+        static const Atom define = Atoms::intern("define");
+        static const Atom definePure = Atoms::intern("define-pure");
+
+        if (token.atom == define) {
             symbol = RSRV_DEFINE;
             return true;
         }
+        if (token.atom == definePure) {
+            symbol = RSRV_DEFINE_PURE;
+            return true;
+        }
         symbol = RSRV_NULL;
         return false;
     }
 
+    /*
+     * <reference> := <symbol>
+     *
+     * An argument of the procedure being defined, loaded from its slot in
+     * the frame. Its value is only known when called.
+     */
+    Folded
+    reference (Code &bc, unsigned long slot)
+    {
+        bc.emit(Bytecode(OP_LOAD, REG1, slot));
+        bc.emit(Bytecode(OP_PUSH, REG1));
+        return Folded { false, Primitive(), {} };
+    }
+
     /* <list> := ([<expr> ]*) */
-    void
-    list (std::queue<Bytecode> &bc)
+    Folded
+    list (Code &bc)
     {
         assert(0);
+        return Folded { false, Primitive(), {} };
     }
 
-    /* <call> := <symbol>([<expr> ]*) */
-    void
-    call (std::queue<Bytecode> &bc, Token &symbol)
+    /*
+     * Apply an ancestor's operator to known arguments as the Machine would,
+     * unless it would fail.
+     */
+    static bool
+    apply (Operator op, const std::vector<Primitive>& args, Primitive& value)
+    {
+        switch (op) {
+            case OP_ADD:
+                if (args[0].type() != PRM_INTEGER
+                        || args[1].type() != PRM_INTEGER)
+                    return false;
+                value = Data::add(Data(args[0].integer()),
+                        Data(args[1].integer())).toPrimitive();
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    /*
+     * <call> := <symbol>([<expr> ]*)
+     *
+     * Calls to ancestors with the right number of arguments are emitted as
+     * the ancestor's operator rather than a call frame.
+     *
+     * Calls to pure procedures whose arguments are all known are evaluated
+     * now and guarded by a FOLD, which skips the call for as long as the
+     * procedures it depends on keep their definitions. Inlined ancestors are
+     * applied right here, anything else is run by the Machine.
+     */
+    Folded
+    call (Code &bc, Token &symbol)
     {
+        unsigned long start = bc.size();
+        std::vector<Primitive> args;
+        Folded folded = { true, Primitive(), {} };
+        unsigned long argc = 0;
+        unsigned long nargs;
+        Operator op;
+
         assert(symbol.type == TKN_SYMBOL);
 
         /* parse expressions first to allow arguments onto stack for call */
         expect(TKN_LPAREN);
-        while (peek().type != TKN_RPAREN)
-            expr(bc);
+        while (peek().type != TKN_RPAREN) {
+            Folded arg = expr(bc);
+            folded.known = folded.known && arg.known;
+            args.push_back(arg.value);
+            folded.deps.insert(folded.deps.end(),
+                    arg.deps.begin(), arg.deps.end());
+            argc++;
+        }
         next();
 
-        bc.push(Bytecode(OP_CALL, Primitive(PRM_SYMBOL, symbol.str)));
+        uint64_t sym = bc.constant(Primitive(PRM_SYMBOL, symbol.atom));
+        bool inlined = _machine.ancestor(symbol.atom, op, nargs)
+            && argc == nargs;
+        if (inlined)
+            bc.emitInline(Bytecode(op), sym);
+        else
+            bc.emitCall(Bytecode(OP_CALL, sym), argc);
+
+        folded.known = folded.known && _machine.pure(symbol.atom)
+            && _machine.numArgs(symbol.atom) == argc;
+        if (folded.known && inlined) {
+            folded.known = apply(op, args, folded.value);
+            folded.deps.push_back(_machine.dependency(symbol.atom));
+        }
+        else if (folded.known)
+            folded.known = _machine.evaluate(symbol.atom, args,
+                    folded.value, folded.deps);
+        if (folded.known)
+            bc.fold(start, folded.value, folded.deps);
+        return folded;
     }
 
-    /* <expr> := <reserved> | <call> | <list> | <literal> */
-    void
-    expr (std::queue<Bytecode> &bc)
+    /* <expr> := <reserved> | <call> | <list> | <reference> | <literal> */
+    Folded
+    expr (Code &bc)
     {
         Token token = next();
         if (token.type == TKN_SYMBOL) {
             ReservedSymbol reserved_symbol;
-            if (isReserved(token, reserved_symbol)) {
-                reserved(bc, reserved_symbol);
-                return;
-            }
-
-            if (peek().type == TKN_LPAREN) {
-                call(bc, token);
-                return;
-            }
+            unsigned long slot;
+            if (isReserved(token, reserved_symbol))
+                return reserved(bc, reserved_symbol);
+
+            if (peek().type == TKN_LPAREN)
+                return call(bc, token);
+
+            if (_frame.lookup(token.atom, slot))
+                return reference(bc, slot);
         }
         else if (token.type == TKN_LPAREN) {
-            list(bc);
-            return;
+            return list(bc);
         }
 
-        literal(bc, token);
+        return literal(bc, token);
     }
 };
 
@@ -206,7 +346,8 @@ private:
  * <reserved> := push | pop | define | print | add ; etc.
  * <call> := <symbol>([<expr> ]*)
  * <list> := ([<expr> ]*)
- * <expr> := <reserved> | <symbol> | <call> | <list> | <literal>
+ * <reference> := <symbol> ; an argument of the enclosing define
+ * <expr> := <reserved> | <reference> | <call> | <list> | <literal>
  *
  * Ancestors are simply special pre-defined procedures which make direct use of
  * machine primitives. All newly defined procedures may use
@@ -2,20 +2,19 @@
 #define SCRIBBLE_DATA
 
 #include <cstdio>
+#include <cstdint>
 #include <string>
 #include <cassert>
-#include "bytecode.hpp"
 #include "primitive.hpp"
 
-typedef enum {
-    DATA_NULL,
-    DATA_PRIMITIVE,
-    DATA_CODE
-} DataType;
-
 /*
- * Represents a Word of memory on the stack. But since we have a runtime, we
- * can include stuff like type information.
+ * Represents a Word of memory on the stack as a single 64-bit tagged value.
+ * Integers are unboxed: shifted left by one with the low bit set, so only
+ * 63 bits of them fit. They range from 0 to INTEGER_MAX, 2^63 - 1, and
+ * addition wraps modulo 2^63. Strings
+ * and symbols are pointers to interned std::strings which are at least
+ * 8-byte aligned, leaving the low three bits for the tag. The all-zero word
+ * is NULL. This matches the width of the i64 data stack used by the JIT.
  *
  * TODO: Should perhaps think about an immutable implementation so that values
  * always remain exactly as they were first set. We want this because we don't
@@ -24,95 +23,125 @@ typedef enum {
  */
 struct Data
 {
+    static const uint64_t TAG_INTEGER = 0x1;
+    static const uint64_t TAG_STRING  = 0x2;
+    static const uint64_t TAG_SYMBOL  = 0x4;
+    static const uint64_t TAG_MASK    = 0x7;
+
+    static const uint64_t INTEGER_MAX = (1UL << 63) - 1;
+
     Data ()
-        : _type(DATA_NULL)
-        , _primitive(Primitive())
-        , _bytecode(Bytecode())
-        , _is_executable(false)
+        : word(0)
     {}
 
     Data (unsigned long integer)
-        : _type(DATA_PRIMITIVE)
-        , _primitive(Primitive(integer))
-        , _bytecode(Bytecode())
-        , _is_executable(false)
-    {}
+        : word((integer << 1) | TAG_INTEGER)
+    {
+        assert(integer <= INTEGER_MAX);
+    }
 
-    Data (Bytecode bytecode)
-        : _type(DATA_CODE)
-        , _primitive(Primitive())
-        , _bytecode(bytecode)
-        , _is_executable(true)
-    {}
+    static Data
+    string (const std::string *s)
+    {
+        return tagged(s, TAG_STRING);
+    }
 
-    DataType
-    type () const
+    static Data
+    symbol (const std::string *s)
     {
-        return _type;
+        return tagged(s, TAG_SYMBOL);
     }
 
-    bool
-    isExecutable () const
+    PrimitiveType
+    type () const
     {
-        return _is_executable;
+        if (word & TAG_INTEGER)
+            return PRM_INTEGER;
+        switch (word & TAG_MASK) {
+            case TAG_STRING: return PRM_STRING;
+            case TAG_SYMBOL: return PRM_SYMBOL;
+            default:         return PRM_NULL;
+        }
     }
 
-    void
-    assign (Data& data)
+    unsigned long
+    integer () const
     {
-        _type = data._type;
-        _primitive = data._primitive;
-        _bytecode = data._bytecode;
-        _is_executable = data._is_executable;
+        assert(type() == PRM_INTEGER);
+        return word >> 1;
     }
 
-    void
-    assign (Primitive primitive)
+    const std::string&
+    string () const
     {
-        _type = DATA_PRIMITIVE;
-        _primitive = primitive;
+        assert(type() == PRM_STRING);
+        return *pointer();
     }
 
-    void
-    assign (Bytecode bytecode)
+    const std::string&
+    symbol () const
     {
-        _type = DATA_CODE;
-        /*
-         * TODO instead mark parts of the stack executable during creation.
-         */
-        _is_executable = true;
-        _bytecode = bytecode;
+        assert(type() == PRM_SYMBOL);
+        return *pointer();
     }
 
-    Primitive
-    primitive ()
+    /* Add two integers without untagging either of them */
+    static Data
+    add (Data a, Data b)
     {
-        assert(_type == DATA_PRIMITIVE);
-        return _primitive;
+        assert(a.type() == PRM_INTEGER && b.type() == PRM_INTEGER);
+        Data d;
+        d.word = a.word + b.word - TAG_INTEGER;
+        return d;
     }
 
-    Bytecode
-    bytecode ()
+    Primitive
+    toPrimitive () const
     {
-        assert(_type == DATA_CODE);
-        return _bytecode;
+        switch (type()) {
+            case PRM_INTEGER: return Primitive(integer());
+            case PRM_STRING:  return Primitive(string());
+            case PRM_SYMBOL:  return Primitive(PRM_SYMBOL, symbol());
+            default:          return Primitive();
+        }
     }
 
     std::string
-    toString ()
+    toString () const
     {
-        switch (_type) {
-            case DATA_CODE:      return "<code>";
-            case DATA_PRIMITIVE: return _primitive.toString();
-            default:             return "NULL";
+        switch (type()) {
+            case PRM_INTEGER: return std::to_string(integer());
+            case PRM_STRING:  return "\"" + string() + "\"";
+            case PRM_SYMBOL:  return symbol();
+            default:          return "NULL";
         }
     }
 
+    void
+    print () const
+    {
+        printf("%s\n", toString().c_str());
+    }
+
+    uint64_t word;
+
 protected:
-    DataType _type;
-    Primitive _primitive;
-    Bytecode _bytecode;
-    bool _is_executable;
+    static Data
+    tagged (const std::string *s, uint64_t tag)
+    {
+        assert(((uintptr_t) s & TAG_MASK) == 0);
+        Data d;
+        d.word = (uint64_t) (uintptr_t) s | tag;
+        return d;
+    }
+
+    const std::string*
+    pointer () const
+    {
+        return (const std::string*) (uintptr_t) (word & ~TAG_MASK);
+    }
 };
 
+static_assert(sizeof(Data) == 8, "Data should be a single word");
+
 #endif
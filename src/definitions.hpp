@@ -1,6 +1,9 @@
 #ifndef SCRIBBLE_DEFINITIONS
 #define SCRIBBLE_DEFINITIONS
 
+#include <string>
+#include <cstdint>
+
 #define REPL_INPUT_STR  "< "
 #define REPL_OUTPUT_STR "> "
 #define REPL_INFO_STR   "| "
@@ -8,7 +11,16 @@
 #define REPL_SYMBOL "::repl::"
 #define NUM_ARG_REGISTERS 3
 
-typedef enum {
+/*
+ * Threaded dispatch relies on GCC's labels-as-values extension. Compilers
+ * without it (or builds defining SCRIBBLE_NO_THREADED) only get the switch
+ * loop.
+ */
+#if defined(__GNUC__) && !defined(SCRIBBLE_NO_THREADED)
+#define SCRIBBLE_THREADED 1
+#endif
+
+typedef enum : uint8_t {
     REGNULL = 0,
     REG1,
     REG2,
@@ -18,7 +30,7 @@ typedef enum {
     REGCOUNT
 } Register;
 
-typedef enum {
+typedef enum : uint8_t {
     OP_NULL,
     OP_HALT,
     OP_MOVESTR,
@@ -27,50 +39,89 @@ typedef enum {
     OP_LOADSTR,
     OP_LOADINT,
     OP_LOADSYM,
+    OP_LOAD,
     OP_PUSH,
     OP_POP,
     OP_CALL,
     OP_RET,
     OP_ADD,
     OP_PRINT,
+
+    /*
+     * Superinstructions, emitted by the peephole pass. CALLRET is a CALL
+     * followed by a RET, which only appears when an inlined ADDRET is
+     * patched back into a call.
+     */
+    OP_PUSHINT,
+    OP_PUSHCONST,
+    OP_PUSHLOAD,
+    OP_ADDRET,
+    OP_CALLRET,
+
+    /*
+     * Push a value computed at compile time and skip the instructions which
+     * compute it, unless a procedure it depends on has been redefined.
+     */
+    OP_FOLD,
+
+    /*
+     * A CALL in tail position, which replaces the caller's frame with the
+     * callee's. It is always followed by a RET.
+     */
+    OP_TAILCALL,
+    NUM_OP
 } Operator;
 
-//static std::string
-//registerString (Register reg)
-//{
-//    switch (reg) {
-//        case REGNULL:  return "NULL"; break;
-//        case REG1:     return "REG1"; break;
-//        case REG2:     return "REG2"; break;
-//        case REG3:     return "REG3"; break;
-//        case REGCALL:  return "REGCALL"; break;
-//        case REGBASE:  return "REGBASE"; break;
-//        case REGCOUNT: return "REGCOUNT"; break;
-//        default:
-//            return "!-! BAD REGISTER !-!";
-//    }
-//}
-//
-//static std::string
-//operatorString (Operator op)
-//{
-//    switch (op) {
-//        case OP_NULL:    return "NULL"; break;
-//        case OP_HALT:    return "HALT"; break;
-//        case OP_MOVEINT: return "MOVEINT"; break;
-//        case OP_MOVESTR: return "MOVESTR"; break;
-//        case OP_MOVESYM: return "MOVESYM"; break;
-//        case OP_LOADINT: return "LOADINT"; break;
-//        case OP_LOADSTR: return "LOADSTR"; break;
-//        case OP_PUSH:    return "PUSH"; break;
-//        case OP_POP:     return "POP"; break;
-//        case OP_CALL:    return "CALL"; break;
-//        case OP_RET:     return "RET"; break;
-//        case OP_ADD:     return "ADD"; break;
-//        case OP_PRINT:   return "PRINT"; break;
-//        default:
-//            return "!-! BAD OP !-!";
-//    }
-//}
+typedef enum {
+    DISPATCH_SWITCH,
+    DISPATCH_THREADED
+} Dispatch;
+
+static inline std::string
+registerString (Register reg)
+{
+    switch (reg) {
+        case REGNULL:  return "NULL"; break;
+        case REG1:     return "REG1"; break;
+        case REG2:     return "REG2"; break;
+        case REG3:     return "REG3"; break;
+        case REGCALL:  return "REGCALL"; break;
+        case REGBASE:  return "REGBASE"; break;
+        case REGCOUNT: return "REGCOUNT"; break;
+        default:
+            return "!-! BAD REGISTER !-!";
+    }
+}
+
+static inline std::string
+operatorString (Operator op)
+{
+    switch (op) {
+        case OP_NULL:    return "NULL"; break;
+        case OP_HALT:    return "HALT"; break;
+        case OP_MOVEINT: return "MOVEINT"; break;
+        case OP_MOVESTR: return "MOVESTR"; break;
+        case OP_MOVESYM: return "MOVESYM"; break;
+        case OP_LOADINT: return "LOADINT"; break;
+        case OP_LOADSTR: return "LOADSTR"; break;
+        case OP_LOADSYM: return "LOADSYM"; break;
+        case OP_LOAD:    return "LOAD"; break;
+        case OP_PUSH:    return "PUSH"; break;
+        case OP_POP:     return "POP"; break;
+        case OP_CALL:    return "CALL"; break;
+        case OP_RET:     return "RET"; break;
+        case OP_ADD:     return "ADD"; break;
+        case OP_PRINT:   return "PRINT"; break;
+        case OP_PUSHINT:   return "PUSHINT"; break;
+        case OP_PUSHCONST: return "PUSHCONST"; break;
+        case OP_PUSHLOAD:  return "PUSHLOAD"; break;
+        case OP_ADDRET:    return "ADDRET"; break;
+        case OP_CALLRET:   return "CALLRET"; break;
+        case OP_FOLD:      return "FOLD"; break;
+        case OP_TAILCALL:  return "TAILCALL"; break;
+        default:
+            return "!-! BAD OP !-!";
+    }
+}
 
 #endif
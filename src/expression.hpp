@@ -54,13 +54,13 @@ public:
     unsigned long
     integer ()
     {
-        return std::stoi(token.str);
+        return token.integer;
     }
 
     std::string
     string ()
     {
-        return token.str;
+        return token.text();
     }
 
     void
@@ -76,7 +76,7 @@ public:
         for (int i = 0; i < idx; i++)
             putchar(' ');
 
-        printf("%s", token.str.c_str());
+        printf("%s", token.text().c_str());
         if (token.type != TKN_SYMBOL) {
             putchar('\n');
             return;
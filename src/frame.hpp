@@ -1,22 +1,50 @@
 #ifndef SCRIBBLE_FRAME
 #define SCRIBBLE_FRAME
 
-#include <map>
+#include <unordered_map>
+#include <vector>
 #include <string>
 #include "definitions.hpp"
+#include "token.hpp"
+#include "error.hpp"
 
 /*
  * Look up definitions within a frame, e.g. local variable, arguments to the
  * function, etc.
+ *
+ * This is the compile-time view of a procedure's frame. The caller pushes the
+ * arguments in order and they become the bottom of the callee's frame, so
+ * each argument name resolves to a fixed slot from the frame's base which
+ * `load` addresses directly.
  */
 
 class Frame {
 public:
+    Frame ()
+    {}
 
-protected:
-    std::map<std::string, Register> arguments;
+    Frame (const std::vector<Token>& args)
+    {
+        for (unsigned long i = 0; i < args.size(); i++) {
+            if (arguments.count(args[i].atom))
+                fatal("Duplicate argument `%s'", Atoms::name(args[i].atom).c_str());
+            arguments[args[i].atom] = i;
+        }
+    }
+
+    /* Find the slot of the argument `name`, if it is one */
+    bool
+    lookup (Atom name, unsigned long& slot) const
+    {
+        auto iter = arguments.find(name);
+        if (iter == arguments.end())
+            return false;
+        slot = iter->second;
+        return true;
+    }
 
-private:
+protected:
+    std::unordered_map<Atom, unsigned long> arguments;
 };
 
 #endif
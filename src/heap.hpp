@@ -0,0 +1,197 @@
+#ifndef SCRIBBLE_HEAP
+#define SCRIBBLE_HEAP
+
+#include <algorithm>
+#include <map>
+#include <vector>
+#include "bytecode.hpp"
+#include "region.hpp"
+
+/* Instructions the code heap has room for, committed as they are used */
+#define CODE_SIZE (1UL << 24)
+
+/* Dead instructions worth compacting, provided there are more than live ones */
+#define CODE_GARBAGE 4096
+
+/*
+ * Where compaction moved each live body, by its old entry. Addresses in dead
+ * bodies have nowhere to go.
+ */
+class Relocation
+{
+public:
+    struct Move
+    {
+        unsigned long to;
+        unsigned long size;
+    };
+
+    /* Find where the instruction at `address` went, if it was live */
+    bool
+    find (unsigned long address, unsigned long& to) const
+    {
+        if (address < floor) {
+            to = address;
+            return true;
+        }
+
+        auto iter = moves.upper_bound(address);
+        if (iter == moves.begin())
+            return false;
+        iter--;
+        if (address >= iter->first + iter->second.size)
+            return false;
+        to = iter->second.to + (address - iter->first);
+        return true;
+    }
+
+    unsigned long floor;
+    std::map<unsigned long, Move> moves;
+};
+
+/*
+ * Bytecode for every procedure, kept apart from the data stack. The heap
+ * grows as code is added without moving, so pointers to instructions stay
+ * valid until the heap is compacted.
+ *
+ * Each owner, i.e. a procedure, has one live body in the heap. Claiming a
+ * new body for an owner leaves its old one dead, and compaction slides the
+ * live bodies down over the dead ones. Code below the floor, which is pinned
+ * once the Machine's stubs are in place, never moves.
+ */
+class CodeHeap
+{
+public:
+    CodeHeap ()
+        : region(CODE_SIZE * sizeof(Bytecode), "Define: code heap overflow")
+        , code((Bytecode*) region.start())
+        , top(0)
+        , floor(0)
+        , live(0)
+    {}
+
+    Bytecode*
+    at (unsigned long idx)
+    {
+        return code + idx;
+    }
+
+    /* The index the next instruction is pushed at */
+    unsigned long
+    index () const
+    {
+        return top;
+    }
+
+    /* An overflow faults, see Region */
+    void
+    push (Bytecode bc)
+    {
+        code[top] = bc;
+        top++;
+    }
+
+    /* Drop the code from `idx` on, and the bodies in it */
+    void
+    rollback (unsigned long idx)
+    {
+        for (auto iter = bodies.begin(); iter != bodies.end(); ) {
+            if (iter->second.entry >= idx) {
+                live -= iter->second.size;
+                iter = bodies.erase(iter);
+            }
+            else
+                iter++;
+        }
+        top = idx;
+    }
+
+    /* Replace the code and bodies with a copy of `other`'s */
+    void
+    copy (const CodeHeap& other)
+    {
+        std::copy(other.code, other.code + other.top, code);
+        top = other.top;
+        floor = other.floor;
+        live = other.live;
+        bodies = other.bodies;
+    }
+
+    /* Never move the code there is so far */
+    void
+    pin ()
+    {
+        floor = top;
+    }
+
+    /* The `size` instructions at `entry` are now `owner`'s only live body */
+    void
+    claim (unsigned long owner, unsigned long entry, unsigned long size)
+    {
+        auto iter = bodies.find(owner);
+        if (iter != bodies.end())
+            live -= iter->second.size;
+        bodies[owner] = Body { entry, size };
+        live += size;
+    }
+
+    /* The number of instructions above the floor in dead bodies */
+    unsigned long
+    garbage () const
+    {
+        return top - floor - live;
+    }
+
+    unsigned long
+    getLive () const
+    {
+        return live;
+    }
+
+    /*
+     * Slide every live body down over the dead code before it, in the order
+     * they are in the heap, and return where each went.
+     */
+    Relocation
+    compact ()
+    {
+        std::vector<std::pair<unsigned long, Body*>> order;
+        for (auto& body : bodies)
+            order.push_back({ body.second.entry, &body.second });
+        std::sort(order.begin(), order.end());
+
+        Relocation relocation;
+        relocation.floor = floor;
+        unsigned long dest = floor;
+        for (auto& item : order) {
+            Body& body = *item.second;
+            std::copy(code + body.entry, code + body.entry + body.size,
+                    code + dest);
+            if (body.size > 0)
+                relocation.moves[body.entry] =
+                    Relocation::Move { dest, body.size };
+            body.entry = dest;
+            dest += body.size;
+        }
+
+        std::fill(code + dest, code + top, Bytecode());
+        top = dest;
+        return relocation;
+    }
+
+protected:
+    struct Body
+    {
+        unsigned long entry;
+        unsigned long size;
+    };
+
+    Region region;
+    Bytecode *code;
+    unsigned long top;
+    unsigned long floor;
+    unsigned long live;
+    std::map<unsigned long, Body> bodies;
+};
+
+#endif
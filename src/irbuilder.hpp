@@ -2,38 +2,48 @@
 #define SCRIBBLE_IRBUILDER
 
 #include "ir.hpp"
+#include "primitive.hpp"
 
 /*
  * Interactively build and output an IR object.
+ *
+ * The top of the stack is loaded from `@top` once, kept in a register while
+ * the function pushes and only written back to `@top` as the function
+ * returns to whoever called it, e.g. the REPL.
+ *
+ * Values are pushed through the runtime's helpers, which are always inlined.
+ * The type of each value on the stack is kept in the byte at the same index
+ * of `@types`, written next to the value. Code whose types are known
+ * statically, e.g. code built ahead of time, may be built untagged.
  */
 class IRBuilder {
 public:
-    IRBuilder () : _tmp(1)
+    IRBuilder () : _tmp(1), _tagged(true)
     {
     }
 
+    /* Write the type of each value pushed to `@types` or not */
+    void
+    setTagged (bool tagged)
+    {
+        _tagged = tagged;
+    }
+
     void
     pushInteger (int number)
     {
         auto n = std::to_string(number);
 
         /*
-         * Get the current top of the stack and write to it. Then calculate the
-         * next stack location and save it as the top.
+         * Write to the current top of the stack and then calculate the next
+         * stack location, which becomes the top.
          */
-        auto curr = tmpvar();
+        auto curr = top();
         auto next = tmpvar();
-        add("%" + curr + " = load i64*, i64** @top, align 8");
-        add("store i64 " + n + ", i64* %" + curr + ", align 8");
-        add("%" + next + " = getelementptr inbounds i64, i64* %" + curr + ", i32 1");
-        add("store i64* %" + next + ", i64** @top, align 8");
-
-        /* 
-         * Here or somewhere near here is where we can optionally add a call to
-         * some internally defined method to book keep type values on the
-         * stack.
-         */
-        add("call void @typestack_pushInteger()");
+        add("%" + next + " = call i64* @scribble_push(i64* %" + curr
+                + ", i64 " + n + ")");
+        tag(curr, PRM_INTEGER);
+        _top = next;
     }
 
     void
@@ -47,13 +57,19 @@ public:
          * all non-primitive types would simply be a pointer. This pointer can
          * be aliased as the pointed-to object can be the explicit value of the
          * pointer or a runtime structure.
+         *
+         * Once a string is pushed its slot is tagged with PRM_STRING.
          */
-        add("call void @typestack_pushString()");
     }
 
+    /* Clear the top of the stack and its tag, which becomes the new top */
     void
     popInteger ()
     {
+        auto curr = top();
+        auto next = tmpvar();
+        add("%" + next + " = call i64* @scribble_pop(i64* %" + curr + ")");
+        _top = next;
     }
 
     void
@@ -94,12 +110,14 @@ public:
     void
     retnum (std::string number)
     {
+       writeback();
        add("ret i32 " + number);
     }
 
     void
     retvoid ()
     {
+       writeback();
        add("ret void");
     }
 
@@ -117,6 +135,10 @@ protected:
     std::vector<std::string> _body;
     std::vector<std::string> _prologue;
     unsigned _tmp;
+    bool _tagged;
+
+    /* the register holding the top of the stack, once it is loaded */
+    std::string _top;
 
     std::string
     tmpvar ()
@@ -126,6 +148,35 @@ protected:
         return s;
     }
 
+    /* The register holding the top, loading it from `@top` the first time */
+    std::string
+    top ()
+    {
+        if (_top.empty()) {
+            _top = tmpvar();
+            add("%" + _top + " = load i64*, i64** @top, align 8");
+        }
+        return _top;
+    }
+
+    /* Store the top back to `@top` if the function has moved it */
+    void
+    writeback ()
+    {
+        if (!_top.empty())
+            add("store i64* %" + _top + ", i64** @top, align 8");
+    }
+
+    /* Write `type` to the byte of `@types` for the slot `%slot` */
+    void
+    tag (std::string slot, PrimitiveType type)
+    {
+        if (!_tagged)
+            return;
+        add("call void @scribble_tag(i64* %" + slot + ", i8 "
+                + std::to_string(type) + ")");
+    }
+
     inline void
     add (std::string s)
     {
@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <vector>
+#include <utime.h>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "cache.hpp"
+
+using namespace llvm;
+
+/* The named metadata the key is left in */
+static const char *KEY = "scribble.cache";
+
+DiskCache::DiskCache ()
+    : capacity(0)
+    , hits(0)
+    , misses(0)
+{}
+
+bool
+DiskCache::open (const std::string& directory, uint64_t capacity)
+{
+    if (sys::fs::create_directories(directory))
+        return false;
+
+    std::lock_guard<std::mutex> guard(lock);
+    this->directory = directory;
+    this->capacity = capacity;
+    evict();
+    return true;
+}
+
+bool
+DiskCache::enabled ()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return !directory.empty();
+}
+
+std::string
+DiskCache::key (const Module& module, const std::string& configuration)
+{
+    std::string ir;
+    raw_string_ostream out(ir);
+    module.print(out, nullptr);
+    out << configuration;
+    out.flush();
+
+    SHA1 hash;
+    hash.update(ir);
+    return toHex(hash.final(), true);
+}
+
+void
+DiskCache::setKey (Module& module, const std::string& key)
+{
+    LLVMContext& context = module.getContext();
+    NamedMDNode *node = module.getOrInsertNamedMetadata(KEY);
+    node->clearOperands();
+    node->addOperand(MDNode::get(context, MDString::get(context, key)));
+}
+
+std::string
+DiskCache::getKey (const Module& module)
+{
+    NamedMDNode *node = module.getNamedMetadata(KEY);
+    if (!node || node->getNumOperands() == 0)
+        return "";
+    return cast<MDString>(node->getOperand(0)->getOperand(0))->getString()
+        .str();
+}
+
+/* The object is now the most recent, whether or not it is compiled yet */
+bool
+DiskCache::fetch (const std::string& key)
+{
+    if (!enabled())
+        return false;
+
+    std::string file = path(key);
+    auto object = MemoryBuffer::getFile(file, false, false);
+    if (!object)
+        return false;
+    utime(file.c_str(), NULL);
+
+    std::lock_guard<std::mutex> guard(lock);
+    fetched.emplace(key, std::move(*object));
+    return true;
+}
+
+void
+DiskCache::clear ()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (directory.empty())
+        return;
+
+    std::error_code ec;
+    for (sys::fs::directory_iterator i(directory, ec), end; i != end && !ec;
+            i.increment(ec))
+        if (sys::path::extension(i->path()) == ".o")
+            sys::fs::remove(i->path());
+}
+
+unsigned long
+DiskCache::getHits ()
+{
+    return hits;
+}
+
+unsigned long
+DiskCache::getMisses ()
+{
+    return misses;
+}
+
+/*
+ * File the object under its module's key. It is written under another name
+ * first so that nobody reads it half-written.
+ */
+void
+DiskCache::notifyObjectCompiled (const Module *module, MemoryBufferRef object)
+{
+    std::string key = getKey(*module);
+    if (key.empty() || !enabled())
+        return;
+
+    std::string file = path(key);
+    SmallString<128> temporary;
+    int fd;
+    if (sys::fs::createUniqueFile(file + ".%%%%%%", fd, temporary))
+        return;
+    {
+        raw_fd_ostream out(fd, true);
+        out << object.getBuffer();
+    }
+    if (sys::fs::rename(temporary, file)) {
+        sys::fs::remove(temporary);
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    evict();
+}
+
+/*
+ * The object fetched for the module's key, or else the one filed under it,
+ * which is now the most recent.
+ */
+std::unique_ptr<MemoryBuffer>
+DiskCache::getObject (const Module *module)
+{
+    std::string key = getKey(*module);
+    if (key.empty())
+        return nullptr;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto held = fetched.find(key);
+        if (held != fetched.end()) {
+            std::unique_ptr<MemoryBuffer> object = std::move(held->second);
+            fetched.erase(held);
+            hits++;
+            return object;
+        }
+    }
+    if (!enabled())
+        return nullptr;
+
+    std::string file = path(key);
+    auto object = MemoryBuffer::getFile(file, false, false);
+    if (!object) {
+        misses++;
+        return nullptr;
+    }
+    hits++;
+    utime(file.c_str(), NULL);
+    return std::move(*object);
+}
+
+std::string
+DiskCache::path (const std::string& key)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    SmallString<128> file(directory);
+    sys::path::append(file, key + ".o");
+    return file.str().str();
+}
+
+/* Remove the least recently used objects until they fit, with the lock held */
+void
+DiskCache::evict ()
+{
+    struct Entry
+    {
+        std::string path;
+        uint64_t size;
+        sys::TimePoint<> used;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+
+    std::error_code ec;
+    for (sys::fs::directory_iterator i(directory, ec), end; i != end && !ec;
+            i.increment(ec)) {
+        if (sys::path::extension(i->path()) != ".o")
+            continue;
+        auto status = i->status();
+        if (!status)
+            continue;
+        entries.push_back({ i->path(), status->getSize(),
+            status->getLastModificationTime() });
+        total += status->getSize();
+    }
+
+    std::sort(entries.begin(), entries.end(),
+        [](const Entry& a, const Entry& b) { return a.used < b.used; });
+    for (auto& entry : entries) {
+        if (total <= capacity)
+            break;
+        if (!sys::fs::remove(entry.path))
+            total -= entry.size;
+    }
+}
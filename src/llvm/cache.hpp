@@ -0,0 +1,70 @@
+#ifndef SCRIBBLE_CACHE
+#define SCRIBBLE_CACHE
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+/*
+ * Objects the JIT has compiled, kept in a directory across runs. An object is
+ * filed under the key of the module it was compiled from, which hashes the
+ * module's IR as it was before being optimized together with how it is
+ * optimized and the target it is compiled for. The JIT fetches the object
+ * before optimizing so that a module found in the cache is neither optimized
+ * nor compiled again, and leaves the key in the module for the compiler. The
+ * fetched object is held until the compiler asks for it, so an object evicted
+ * in between is never compiled again from the unoptimized module.
+ *
+ * Once the directory holds more than `capacity` bytes the least recently used
+ * objects are removed. The cache is disabled until it is given a directory.
+ */
+class DiskCache : public llvm::ObjectCache
+{
+public:
+    DiskCache ();
+
+    /* Keep objects in `directory`, creating it if need be */
+    bool open (const std::string& directory, uint64_t capacity);
+
+    bool enabled ();
+
+    /* The key of `module`, compiled as described by `configuration` */
+    static std::string key (const llvm::Module& module,
+                            const std::string& configuration);
+
+    /* Leave `key` in the module for getObject and notifyObjectCompiled */
+    static void setKey (llvm::Module& module, const std::string& key);
+
+    /* Read the object filed under `key`, if any, and hold it for getObject */
+    bool fetch (const std::string& key);
+
+    /* Remove every object from the directory */
+    void clear ();
+
+    unsigned long getHits ();
+    unsigned long getMisses ();
+
+    void notifyObjectCompiled (const llvm::Module *module,
+                               llvm::MemoryBufferRef object) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject (
+            const llvm::Module *module) override;
+
+protected:
+    std::mutex lock;
+    std::string directory;
+    uint64_t capacity;
+    std::atomic<unsigned long> hits;
+    std::atomic<unsigned long> misses;
+    std::multimap<std::string, std::unique_ptr<llvm::MemoryBuffer>> fetched;
+
+    static std::string getKey (const llvm::Module& module);
+    std::string path (const std::string& key);
+    void evict ();
+};
+
+#endif
@@ -0,0 +1,478 @@
+#include "codegen.hpp"
+
+using namespace llvm;
+
+Codegen::Codegen (Module& module, const NativeBody& body, Addresses address)
+    : _module(module)
+    , _body(body)
+    , _address(address)
+    , _builder(module.getContext())
+    , _function(NULL)
+    , _word(Type::getInt64Ty(module.getContext()))
+    , _pointer(PointerType::getUnqual(_word))
+    , _top(NULL)
+    , _base(NULL)
+{}
+
+bool
+Codegen::procedure (const std::string& name)
+{
+    LLVMContext& context = _module.getContext();
+    FunctionType *type = FunctionType::get(_pointer,
+            { _pointer, Type::getInt8PtrTy(context), _word }, false);
+
+    /* a procedure built after its callers fills in their declaration */
+    _function = _module.getFunction(name);
+    if (!_function)
+        _function = Function::Create(type, Function::ExternalLinkage, name,
+                _module);
+    _top = _function->getArg(0);
+    _top->setName("top");
+    _function->getArg(1)->setName("machine");
+    _function->getArg(2)->setName("site");
+
+    _builder.SetInsertPoint(block("entry"));
+    _base = slot(_top, -((long) _body.nargs));
+    overflow();
+    nest();
+    for (int i = 0; i < REGCOUNT; i++)
+        _regs[i] = word(Data());
+
+    /*
+     * Instructions after a return are dead unless a fold skips to them, in
+     * which case they start the fold's join.
+     */
+    for (unsigned long i = 0; i <= _body.size; i++) {
+        if (_edges.count(i))
+            join(i);
+        if (i == _body.size || terminated())
+            continue;
+        if (!instruction(i)) {
+            _function->deleteBody();
+            if (_function->use_empty())
+                _function->eraseFromParent();
+            return false;
+        }
+    }
+    if (!terminated())
+        _builder.CreateUnreachable();
+    return true;
+}
+
+bool
+Codegen::instruction (unsigned long i)
+{
+    const Bytecode& bc = _body.code[i];
+    const std::vector<Data>& constants = *_body.constants;
+
+    switch (bc.op) {
+        case OP_MOVEINT:
+            _regs[bc.reg1] = word(Data((unsigned long) bc.operand));
+            return true;
+
+        case OP_MOVESTR:
+        case OP_MOVESYM:
+            _regs[bc.reg1] = word(constants[bc.operand]);
+            return true;
+
+        /* the verifier has already proven the type of typed loads */
+        case OP_LOADINT:
+        case OP_LOADSTR:
+        case OP_LOADSYM:
+        case OP_LOAD:
+            _regs[bc.reg1] = load((long) bc.operand);
+            return true;
+
+        case OP_PUSH:
+            push(_regs[bc.reg1]);
+            return true;
+
+        case OP_POP:
+            _regs[bc.reg1] = pop();
+            return true;
+
+        case OP_PUSHINT:
+            push(word(Data((unsigned long) bc.operand)));
+            return true;
+
+        case OP_PUSHCONST:
+            push(word(constants[bc.operand]));
+            return true;
+
+        case OP_PUSHLOAD:
+            push(load((long) bc.operand));
+            return true;
+
+        case OP_ADD:
+            add();
+            return true;
+
+        case OP_ADDRET:
+            add();
+            ret();
+            return true;
+
+        case OP_PRINT:
+            print();
+            return true;
+
+        case OP_CALL:
+            call(_body.callees.at(i), bc.operand);
+            return true;
+
+        /* a TAILCALL is always followed by a RET */
+        case OP_TAILCALL:
+        case OP_CALLRET:
+            if (_body.tails.count(i)) {
+                tailcall(_body.callees.at(i), bc.operand, _body.tails.at(i));
+                return true;
+            }
+            call(_body.callees.at(i), bc.operand);
+            if (bc.op == OP_CALLRET)
+                ret();
+            return true;
+
+        case OP_RET:
+            ret();
+            return true;
+
+        case OP_FOLD:
+            fold(bc.operand, _body.folds.at(i));
+            return true;
+
+        /* HALT only ends code run from the REPL, never a procedure */
+        default:
+            return false;
+    }
+}
+
+bool
+Codegen::terminated ()
+{
+    return _builder.GetInsertBlock()->getTerminator() != NULL;
+}
+
+/* Strings and symbols are addresses, anything else is its own value */
+Constant*
+Codegen::word (Data data)
+{
+    PrimitiveType type = data.type();
+    if (type == PRM_STRING || type == PRM_SYMBOL)
+        return ConstantExpr::getPtrToInt(address(data.word), _word);
+    return ConstantInt::get(_word, data.word);
+}
+
+/*
+ * The symbol standing for `address`, which the module may already define.
+ * Otherwise it is declared as a byte so that LLVM assumes nothing of its
+ * alignment, leaving the tag bits of a tagged word be.
+ */
+Constant*
+Codegen::address (uint64_t address)
+{
+    std::string name = _address(address);
+    if (GlobalValue *value = _module.getNamedValue(name))
+        return value;
+    return _module.getOrInsertGlobal(name,
+            Type::getInt8Ty(_module.getContext()));
+}
+
+/* A pointer `offset` slots from `from` */
+Value*
+Codegen::slot (Value *from, long offset)
+{
+    return _builder.CreateInBoundsGEP(_word, from,
+            ConstantInt::get(_word, offset, true));
+}
+
+void
+Codegen::push (Value *value)
+{
+    _builder.CreateStore(value, _top);
+    _top = slot(_top, 1);
+}
+
+/* Pop the top of the stack, clearing its slot as the Machine does */
+Value*
+Codegen::pop ()
+{
+    _top = slot(_top, -1);
+    Value *v = _builder.CreateLoad(_word, _top);
+    _builder.CreateStore(word(Data()), _top);
+    return v;
+}
+
+/* The value `load` addresses with `index`, as in the Machine */
+Value*
+Codegen::load (long index)
+{
+    Value *p = index < 0 ? slot(_top, index) : slot(_base, index);
+    return _builder.CreateLoad(_word, p);
+}
+
+/*
+ * Add two tagged integers, as in Data::add. Anything else is handed to
+ * machine_add, so that it fails just as it does when interpreted.
+ */
+void
+Codegen::add ()
+{
+    Value *a = pop();
+    Value *b = pop();
+    Value *tag = ConstantInt::get(_word, Data::TAG_INTEGER);
+    BasicBlock *integers = block("integers");
+    BasicBlock *mistyped = block("mistyped");
+    BasicBlock *added = block("added");
+
+    Value *both = _builder.CreateAnd(_builder.CreateAnd(a, b), tag);
+    _builder.CreateCondBr(_builder.CreateICmpNE(both,
+                ConstantInt::get(_word, 0)), integers, mistyped);
+
+    _builder.SetInsertPoint(integers);
+    Value *sum = _builder.CreateSub(_builder.CreateAdd(a, b), tag);
+    _builder.CreateBr(added);
+
+    _builder.SetInsertPoint(mistyped);
+    FunctionCallee hook = _module.getOrInsertFunction("machine_add",
+            FunctionType::get(_word, { _word, _word }, false));
+    Value *slow = _builder.CreateCall(hook, { a, b });
+    _builder.CreateBr(added);
+
+    _builder.SetInsertPoint(added);
+    PHINode *result = _builder.CreatePHI(_word, 2);
+    result->addIncoming(sum, integers);
+    result->addIncoming(slow, mistyped);
+    push(result);
+}
+
+/* Call the stub of `callee` through the call site at `site` */
+void
+Codegen::call (const std::string& callee, uint64_t site)
+{
+    FunctionCallee stub = _module.getOrInsertFunction(callee,
+            _function->getFunctionType());
+    _top = _builder.CreateCall(stub, { _top, _function->getArg(1),
+            ConstantInt::get(_word, site) });
+}
+
+/*
+ * Move the arguments down to the base, clear the rest of the frame and let
+ * the callee return in our place. As it returns exactly one value, which it
+ * leaves at the base, that is what the frame would have returned anyway.
+ */
+void
+Codegen::tailcall (const std::string& callee,
+                   uint64_t site,
+                   unsigned long nargs)
+{
+    Value *args = slot(_top, -((long) nargs));
+    if (nargs > 0)
+        _builder.CreateMemMove(_base, MaybeAlign(sizeof(uint64_t)), args,
+                MaybeAlign(sizeof(uint64_t)), nargs * sizeof(uint64_t));
+    Value *top = slot(_base, nargs);
+    clear(top, _body.depth - nargs);
+
+    FunctionCallee stub = _module.getOrInsertFunction(callee,
+            _function->getFunctionType());
+    CallInst *call = _builder.CreateCall(stub, { top, _function->getArg(1),
+            ConstantInt::get(_word, site) });
+    call->setTailCallKind(CallInst::TCK_MustTail);
+    _builder.CreateRet(call);
+}
+
+/*
+ * Make sure the whole frame fits on the stack. The Machine checks this before
+ * calling into native code, but calls between native procedures bypass it.
+ */
+void
+Codegen::overflow ()
+{
+    Value *end = slot(_base, _body.depth);
+    Value *limit = ConstantExpr::getBitCast(
+            address((uintptr_t) _body.limit), _pointer);
+    BasicBlock *fits = block("fits");
+    BasicBlock *overflows = block("overflow");
+
+    _builder.CreateCondBr(_builder.CreateICmpUGT(end, limit), overflows,
+            fits);
+
+    _builder.SetInsertPoint(overflows);
+    FunctionCallee hook = _module.getOrInsertFunction("machine_overflow",
+            FunctionType::get(_builder.getVoidTy(), false));
+    _builder.CreateCall(hook);
+    _builder.CreateUnreachable();
+
+    _builder.SetInsertPoint(fits);
+}
+
+/*
+ * Give up once the C stack has grown past `machine_floor`. Native calls other
+ * than tail calls nest on the C stack, which would otherwise overflow long
+ * before the Machine's frames would.
+ */
+void
+Codegen::nest ()
+{
+    Type *bytes = Type::getInt8PtrTy(_module.getContext());
+    Function *frameaddress = Intrinsic::getDeclaration(&_module,
+            Intrinsic::frameaddress, { bytes });
+    Value *frame = _builder.CreateCall(frameaddress, { _builder.getInt32(0) });
+    Value *floor = _builder.CreateLoad(bytes,
+            _module.getOrInsertGlobal("machine_floor", bytes));
+    BasicBlock *nests = block("nests");
+    BasicBlock *deep = block("deep");
+
+    _builder.CreateCondBr(_builder.CreateICmpULT(frame, floor), deep, nests);
+
+    _builder.SetInsertPoint(deep);
+    FunctionCallee hook = _module.getOrInsertFunction(
+            "machine_frame_overflow",
+            FunctionType::get(_builder.getVoidTy(), false));
+    _builder.CreateCall(hook);
+    _builder.CreateUnreachable();
+
+    _builder.SetInsertPoint(nests);
+}
+
+/* Call a hook which takes and returns the top of the stack */
+void
+Codegen::hook (const char *name, uint64_t operand)
+{
+    Type *machine = Type::getInt8PtrTy(_module.getContext());
+    FunctionCallee callee = _module.getOrInsertFunction(name,
+            FunctionType::get(_pointer, { machine, _pointer, _word }, false));
+    _top = _builder.CreateCall(callee, { _function->getArg(1), _top,
+            ConstantInt::get(_word, operand) });
+}
+
+void
+Codegen::print ()
+{
+    Type *machine = Type::getInt8PtrTy(_module.getContext());
+    FunctionCallee callee = _module.getOrInsertFunction("scribble_print",
+            FunctionType::get(_builder.getVoidTy(), { machine, _pointer },
+                false));
+    _builder.CreateCall(callee, { _function->getArg(1), _top });
+}
+
+/*
+ * The Machine pushes the fold's value if it is still valid, in which case
+ * branch to the end of the instructions computing it.
+ */
+void
+Codegen::fold (uint64_t index, unsigned long end)
+{
+    Value *before = _top;
+    hook("machine_fold", index);
+    Value *folded = _builder.CreateICmpNE(_top, before);
+    BasicBlock *compute = block("compute");
+
+    _builder.CreateCondBr(folded, joinBlock(end), compute);
+    edge(end);
+
+    _builder.SetInsertPoint(compute);
+    _top = before;
+}
+
+/*
+ * Move the top-most value of the frame, if any, down to its base and return.
+ * The rest of the frame is cleared as the Machine does.
+ */
+void
+Codegen::ret ()
+{
+    BasicBlock *value = block("value");
+    BasicBlock *none = block("none");
+    _builder.CreateCondBr(_builder.CreateICmpUGT(_top, _base), value, none);
+
+    _builder.SetInsertPoint(value);
+    _builder.CreateStore(load(-1), _base);
+    Value *rest = slot(_base, 1);
+    clear(rest, _body.depth - 1);
+    _builder.CreateRet(rest);
+
+    _builder.SetInsertPoint(none);
+    clear(_base, _body.depth);
+    _builder.CreateRet(_base);
+}
+
+/* Zero `n` slots from `from` */
+void
+Codegen::clear (Value *from, long n)
+{
+    if (n <= 0)
+        return;
+    _builder.CreateMemSet(from, _builder.getInt8(0), n * sizeof(uint64_t),
+            MaybeAlign(sizeof(uint64_t)));
+}
+
+BasicBlock*
+Codegen::block (const std::string& name)
+{
+    return BasicBlock::Create(_module.getContext(), name, _function);
+}
+
+BasicBlock*
+Codegen::joinBlock (unsigned long offset)
+{
+    auto iter = _joins.find(offset);
+    if (iter != _joins.end())
+        return iter->second;
+    BasicBlock *join = block("join");
+    _joins[offset] = join;
+    return join;
+}
+
+/* Note that the current block branches to the join at `offset` */
+void
+Codegen::edge (unsigned long offset)
+{
+    Edge e;
+    e.from = _builder.GetInsertBlock();
+    e.top = _top;
+    for (int i = 0; i < REGCOUNT; i++)
+        e.regs[i] = _regs[i];
+    _edges[offset].push_back(e);
+}
+
+/* Start the block at `offset` which the edges into it meet at */
+void
+Codegen::join (unsigned long offset)
+{
+    if (!terminated()) {
+        _builder.CreateBr(joinBlock(offset));
+        edge(offset);
+    }
+
+    std::vector<Edge> edges = _edges[offset];
+    _edges.erase(offset);
+    _builder.SetInsertPoint(joinBlock(offset));
+
+    _top = phi(_pointer, edges, -1);
+    for (int i = 0; i < REGCOUNT; i++)
+        _regs[i] = phi(_word, edges, i);
+}
+
+/*
+ * The top, or the register `reg`, merged from each edge. No phi is needed
+ * if they all agree.
+ */
+Value*
+Codegen::phi (Type *type, const std::vector<Edge>& edges, int reg)
+{
+    auto value = [reg](const Edge& e) {
+        return reg < 0 ? e.top : e.regs[reg];
+    };
+
+    bool same = true;
+    for (auto& e : edges)
+        if (value(e) != value(edges[0]))
+            same = false;
+    if (same)
+        return value(edges[0]);
+
+    PHINode *node = _builder.CreatePHI(type, edges.size());
+    for (auto& e : edges)
+        node->addIncoming(value(e), e.from);
+    return node;
+}
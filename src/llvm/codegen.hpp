@@ -0,0 +1,123 @@
+#ifndef SCRIBBLE_CODEGEN
+#define SCRIBBLE_CODEGEN
+
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include "tier.hpp"
+
+/*
+ * Build a verified procedure's bytecode into an LLVM function of type
+ * NativeProcedure, i.e.
+ *
+ *      define i64* @name(i64* %top, i8* %machine, i64 %site)
+ *
+ * Values on the data stack are the same tagged words the Machine uses. The
+ * top of the stack is threaded through the function as an SSA value and the
+ * base of the frame is fixed at entry, `nargs` below the top. Calls go
+ * straight to the callee's stub, passing the call site along in case the
+ * callee is interpreted. A call in tail position hands the callee the frame
+ * when the callee's return value is all that is left of it, as a musttail
+ * call, so that chains of tail calls run in constant space. Other calls
+ * nest on the C stack, so each procedure checks on entry that its frame is
+ * above `machine_floor`, which the Machine sets near the end of the C stack.
+ *
+ * Anything else which needs the Machine goes through a hook, or a runtime
+ * helper which calls one when it must:
+ *
+ *      machine_fold        push a fold's value if it is still valid
+ *      machine_add         add words which aren't both integers
+ *      scribble_print      print the top of the stack, leaving all but
+ *                          integers to machine_print
+ *      machine_overflow    give up as the frame wouldn't fit on the stack
+ *      machine_frame_overflow
+ *                          give up as calls nest too deep for the C stack
+ *
+ * Interned strings and the end of the stack are referred to through symbols
+ * named by `address`, never by their value, so that the function doesn't
+ * depend on where they happen to be in this process and its object may be
+ * cached across runs.
+ *
+ * Registers become SSA values as well. The compiler always sets a register
+ * before using it within a procedure, so they start out NULL rather than as
+ * whatever the Machine last left in them, and the Machine's registers are not
+ * updated.
+ *
+ * Control only moves forward, out of the procedure or from a FOLD to the end
+ * of the instructions it stands in for, so each fold end becomes a block
+ * joining the top and registers of its predecessors.
+ */
+class Codegen
+{
+public:
+    /* Names the symbol which stands for an address */
+    typedef std::function<std::string (uint64_t address)> Addresses;
+
+    Codegen (llvm::Module& module,
+             const NativeBody& body,
+             Addresses address);
+
+    /* Build the function `name` into the module, if possible */
+    bool procedure (const std::string& name);
+
+protected:
+    /* The top and registers at the end of a block branching to a join */
+    struct Edge
+    {
+        llvm::BasicBlock *from;
+        llvm::Value *top;
+        llvm::Value *regs[REGCOUNT];
+    };
+
+    llvm::Module& _module;
+    const NativeBody& _body;
+    Addresses _address;
+    llvm::IRBuilder<> _builder;
+    llvm::Function *_function;
+
+    llvm::Type *_word;
+    llvm::PointerType *_pointer;
+
+    std::map<unsigned long, std::vector<Edge>> _edges;
+    std::map<unsigned long, llvm::BasicBlock*> _joins;
+    llvm::Value *_top;
+    llvm::Value *_base;
+    llvm::Value *_regs[REGCOUNT];
+
+    bool instruction (unsigned long i);
+    bool terminated ();
+
+    llvm::Constant* word (Data data);
+    llvm::Constant* address (uint64_t address);
+    llvm::Value* slot (llvm::Value *from, long offset);
+    void push (llvm::Value *value);
+    llvm::Value* pop ();
+    llvm::Value* load (long index);
+    void add ();
+    void call (const std::string& callee, uint64_t site);
+    void tailcall (const std::string& callee,
+                   uint64_t site,
+                   unsigned long nargs);
+    void hook (const char *name, uint64_t operand);
+    void overflow ();
+    void nest ();
+    void print ();
+    void fold (uint64_t index, unsigned long end);
+    void ret ();
+    void clear (llvm::Value *from, long n);
+
+    llvm::BasicBlock* block (const std::string& name);
+    llvm::BasicBlock* joinBlock (unsigned long offset);
+    void edge (unsigned long offset);
+    void join (unsigned long offset);
+    llvm::Value* phi (llvm::Type *type,
+                      const std::vector<Edge>& edges,
+                      int reg);
+};
+
+#endif
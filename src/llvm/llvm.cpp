@@ -1,106 +1,293 @@
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
 
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LegacyPassManager.h"
-#include "llvm/IR/Mangler.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/ADT/STLExtras.h"
-#include "llvm/ExecutionEngine/ExecutionEngine.h"
-#include "llvm/ExecutionEngine/JITSymbol.h"
-#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
-#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
-#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
-#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
-#include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
-#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
-#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
-#include "llvm/ExecutionEngine/RuntimeDyld.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
-#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/Support/raw_ostream.h"
-#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SHA1.h"
 #include "llvm/Support/TargetSelect.h"
-#include "llvm/Support/SmallVectorMemoryBuffer.h"
-#include "llvm/Target/TargetMachine.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
 #include "llvm.hpp"
+#include "codegen.hpp"
+#include "cache.hpp"
 
 typedef void (*FunctionEntry) ();
 
+/* The runtime's bitcode, assembled from runtime.ll when scribble is built */
+static const unsigned char RUNTIME[] = {
+#include "runtime.inc"
+};
+
+/*
+ * What a program built ahead of time has in place of the Machine's hooks.
+ * Folds are never taken, as there is nothing to tell whether they are still
+ * valid, adding anything but integers is fatal, and words are printed as
+ * Data::print prints them. Strings and symbols point to C strings in the
+ * program. There is no floor to the C stack, which calls may exhaust as
+ * those of any C program may.
+ */
+static const char *PROGRAM_HOOKS =
+    "@.integer = private constant [5 x i8] c\"%lu\\0A\\00\"\n"
+    "@.string = private constant [6 x i8] c\"\\22%s\\22\\0A\\00\"\n"
+    "@.symbol = private constant [4 x i8] c\"%s\\0A\\00\"\n"
+    "@.null = private constant [5 x i8] c\"NULL\\00\"\n"
+    "@.overflow = private constant [22 x i8] c\"Push: stack overflow\\0A\\00\"\n"
+    "@.frames = private constant [28 x i8] c\"Call: frame stack overflow\\0A\\00\"\n"
+    "@.mistyped = private constant [28 x i8] c\"Add: expected two integers\\0A\\00\"\n"
+    "@machine_floor = internal global i8* null\n"
+    "declare i32 @printf(i8*, ...)\n"
+    "declare i32 @puts(i8*)\n"
+    "declare i64 @write(i32, i8*, i64)\n"
+    "declare void @exit(i32)\n"
+    "define i64* @machine_fold(i8* %machine, i64* %top, i64 %fold) {\n"
+    "    ret i64* %top\n"
+    "}\n"
+    "define i64 @machine_add(i64 %a, i64 %b) {\n"
+    "    %s = getelementptr [28 x i8], [28 x i8]* @.mistyped, i64 0, i64 0\n"
+    "    call i64 @write(i32 2, i8* %s, i64 27)\n"
+    "    call void @exit(i32 1)\n"
+    "    unreachable\n"
+    "}\n"
+    "define void @machine_overflow() {\n"
+    "    %s = getelementptr [22 x i8], [22 x i8]* @.overflow, i64 0, i64 0\n"
+    "    call i64 @write(i32 2, i8* %s, i64 21)\n"
+    "    call void @exit(i32 1)\n"
+    "    unreachable\n"
+    "}\n"
+    "define void @machine_frame_overflow() {\n"
+    "    %s = getelementptr [28 x i8], [28 x i8]* @.frames, i64 0, i64 0\n"
+    "    call i64 @write(i32 2, i8* %s, i64 27)\n"
+    "    call void @exit(i32 1)\n"
+    "    unreachable\n"
+    "}\n"
+    "define void @machine_print(i8* %machine, i64* %top) {\n"
+    "    %slot = getelementptr i64, i64* %top, i64 -1\n"
+    "    %word = load i64, i64* %slot\n"
+    "    %low = and i64 %word, 1\n"
+    "    %isint = icmp ne i64 %low, 0\n"
+    "    br i1 %isint, label %integer, label %pointer\n"
+    "integer:\n"
+    "    %n = lshr i64 %word, 1\n"
+    "    %fi = getelementptr [5 x i8], [5 x i8]* @.integer, i64 0, i64 0\n"
+    "    call i32 (i8*, ...) @printf(i8* %fi, i64 %n)\n"
+    "    ret void\n"
+    "pointer:\n"
+    "    %tag = and i64 %word, 7\n"
+    "    %address = and i64 %word, -8\n"
+    "    %p = inttoptr i64 %address to i8*\n"
+    "    switch i64 %tag, label %null [ i64 2, label %string\n"
+    "                                   i64 4, label %symbol ]\n"
+    "string:\n"
+    "    %fs = getelementptr [6 x i8], [6 x i8]* @.string, i64 0, i64 0\n"
+    "    call i32 (i8*, ...) @printf(i8* %fs, i8* %p)\n"
+    "    ret void\n"
+    "symbol:\n"
+    "    %fy = getelementptr [4 x i8], [4 x i8]* @.symbol, i64 0, i64 0\n"
+    "    call i32 (i8*, ...) @printf(i8* %fy, i8* %p)\n"
+    "    ret void\n"
+    "null:\n"
+    "    %fn = getelementptr [5 x i8], [5 x i8]* @.null, i64 0, i64 0\n"
+    "    call i32 @puts(i8* %fn)\n"
+    "    ret void\n"
+    "}\n";
+
 using namespace llvm;
 using namespace llvm::orc;
 
+/*
+ * An LLJIT compiling on a pool of threads. Modules are optimized by the JIT's
+ * transform layer and compiled when something first looks up a symbol in
+ * them, on whichever thread of the pool is free. Symbols which the JIT
+ * doesn't define are looked up in the process, e.g. the Machine's hooks.
+ *
+ * Modules compiled at once need contexts of their own, so every module gets
+ * a new context except those cloned from the declarations, which share its
+ * context.
+ *
+ * Native procedures are only ever called through indirect stubs, which are
+ * defined in the JIT under the procedure's symbol. A stub starts out leading
+ * to the interpreter. Compiling a procedure, or compiling it again once it
+ * is redefined, atomically points its stub at the new function, so callers
+ * never need to be compiled again.
+ *
+ * A hot procedure and the native procedures it calls may also be compiled
+ * together as a cluster, in one module where they call each other directly
+ * and so may be inlined into the root. The cluster is compiled in the
+ * background and the root's stub only points at it once it is ready, if
+ * none of its members was compiled again or interpreted since. Should one of
+ * them be, the root's stub goes back to the root's own function.
+ *
+ * Each module is optimized at the level it was added with, which is left in
+ * the module for the transform layer, by the new pass manager's pipeline for
+ * that level.
+ *
+ * The runtime's helpers are embedded as bitcode, defined in the JIT once and
+ * linked into every module which uses them as available_externally, so that
+ * they may be inlined.
+ *
+ * Compiled objects may be kept in a DiskCache, which the transform layer looks
+ * in before optimizing a module. Native code refers to addresses in this
+ * process, e.g. interned strings, through absolute symbols numbered in the
+ * order they are first needed, so that the same definitions made in the same
+ * order build the same modules in every run.
+ */
 class LLVMJIT
 {
 protected:
-    ExecutionSession ES;
-    std::shared_ptr<SymbolResolver> Resolver;
-    std::unique_ptr<TargetMachine> TM;
-    const DataLayout DL;
-    LegacyRTDyldObjectLinkingLayer ObjectLayer;
-    LegacyIRCompileLayer<decltype(ObjectLayer), SimpleCompiler> CompileLayer;
+    std::unique_ptr<LLJIT> JIT;
+
+    /* the declarations every module but the globals starts from */
+    ThreadSafeContext context;
+    std::unique_ptr<Module> declarations;
+    bool dump;
+
+    /* the procedure stubs and where the stub of an interpreted one leads */
+    std::unique_ptr<IndirectStubsManager> stubs;
+    JITTargetAddress interpreter;
+    unsigned long functions;
+
+    /*
+     * Under `swapLock`, the times each procedure's stub was pointed at a new
+     * function or the interpreter, each procedure's own function and the
+     * members of the cluster each root's stub leads to. `pending` counts the
+     * clusters being compiled.
+     */
+    std::mutex swapLock;
+    std::condition_variable settled;
+    std::map<std::string, unsigned long> generations;
+    std::map<std::string, JITTargetAddress> unmerged;
+    std::map<std::string, std::set<std::string>> clusters;
+    unsigned long pending;
 
-    using OptimizeFunction =
-      std::function<std::unique_ptr<Module>(std::unique_ptr<Module>)>;
+    /* the runtime's helpers, as bitcode, their names and its hash */
+    std::unique_ptr<MemoryBuffer> runtime;
+    std::set<std::string> helpers;
+    std::string runtimeHash;
 
-    LegacyIRTransformLayer<decltype(CompileLayer), OptimizeFunction> OptimizeLayer;
+    /* the symbols standing for addresses native code refers to */
+    std::map<uint64_t, std::string> addresses;
 
-    std::unique_ptr<JITCompileCallbackManager> CompileCallbackMgr;
-    std::unique_ptr<IndirectStubsManager> IndirectStubsMgr;
+    DiskCache cache;
+    CodeGenOpt::Level level;
 
-    LLVMContext context;
-    std::string tmp;
+    /* the time spent in each pass, if passes are timed */
+    std::atomic<bool> timing;
+    std::mutex timesLock;
+    std::map<std::string, double> times;
 
 public:
-    LLVMJIT ()
-        : Resolver(createLegacyLookupResolver(ES,
-            [this](const std::string &Name) -> JITSymbol {
-                if (auto Sym = IndirectStubsMgr->findStub(Name, false))
-                    return Sym;
-                if (auto Sym = OptimizeLayer.findSymbol(Name, false))
-                    return Sym;
-                else if (auto Err = Sym.takeError())
-                    return std::move(Err);
-                if (auto SymAddr =
-                        RTDyldMemoryManager::getSymbolAddressInProcess(Name))
-                    return JITSymbol(SymAddr, JITSymbolFlags::Exported);
-                return nullptr;
-            },
-            [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); }))
-        , TM(EngineBuilder().selectTarget())
-        , DL(TM->createDataLayout())
-        , ObjectLayer(AcknowledgeORCv1Deprecation, ES,
-              [this](VModuleKey K) {
-                  return LegacyRTDyldObjectLinkingLayer::Resources{
-                    std::make_shared<SectionMemoryManager>(), Resolver};
-              })
-        , CompileLayer(AcknowledgeORCv1Deprecation,
-                ObjectLayer, SimpleCompiler(*TM))
-        , OptimizeLayer(AcknowledgeORCv1Deprecation, CompileLayer,
-              [this](std::unique_ptr<Module> M) {
-                  return optimizeModule(std::move(M));
-              })
-        , CompileCallbackMgr(cantFail(
-              orc::createLocalCompileCallbackManager(TM->getTargetTriple(), ES, 0)))
+    LLVMJIT (unsigned threads)
+        : context(std::make_unique<LLVMContext>())
+        , dump(false)
+        , interpreter(0)
+        , functions(0)
+        , pending(0)
+        , level(CodeGenOpt::Default)
+        , timing(false)
+    {
+        auto machine = cantFail(JITTargetMachineBuilder::detectHost());
+        machine.setCodeGenOptLevel(level);
+
+        JIT = cantFail(LLJITBuilder()
+                .setJITTargetMachineBuilder(std::move(machine))
+                .setNumCompileThreads(threads)
+                .setCompileFunctionCreator([this](JITTargetMachineBuilder JTMB)
+                    -> Expected<std::unique_ptr<IRCompileLayer::IRCompiler>> {
+                    return std::make_unique<ConcurrentIRCompiler>(
+                            std::move(JTMB), &cache);
+                })
+                .create());
+
+        auto &main = JIT->getMainJITDylib();
+        main.addGenerator(cantFail(
+            DynamicLibrarySearchGenerator::GetForCurrentProcess(
+                JIT->getDataLayout().getGlobalPrefix())));
+
+        JIT->getIRTransformLayer().setTransform(
+            [this](ThreadSafeModule TSM, MaterializationResponsibility &R) {
+                TSM.withModuleDo([this](Module &M) { transform(M); });
+                return Expected<ThreadSafeModule>(std::move(TSM));
+            });
+
+        declarations = std::make_unique<Module>("declarations",
+                *context.getContext());
+        declarations->setDataLayout(JIT->getDataLayout());
+
+        stubs = createLocalIndirectStubsManagerBuilder(
+                JIT->getTargetTriple())();
+
+        loadRuntime();
+    }
+
+    ~LLVMJIT ()
+    {
+        /* the JIT may still be compiling modules in the declarations' context */
+        settle();
+        JIT.reset();
+    }
+
+    void
+    declare (std::string ir)
     {
-        auto IndirectStubsMgrBuilder =
-            orc::createLocalIndirectStubsManagerBuilder(TM->getTargetTriple());
-        IndirectStubsMgr = IndirectStubsMgrBuilder();
-        llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+        parseInto(ir, *declarations);
     }
 
     void
-    defineIR (std::string ir)
+    setDump (bool dump)
     {
-        auto m = compileIR(ir);
-        /*auto k = */addModule(std::move(m));
+        this->dump = dump;
+    }
+
+    /*
+     * Add the IR to the global definitions and start compiling it on the
+     * pool straight away, so that defining many modules in a row compiles
+     * them all at once.
+     */
+    void
+    defineIR (std::string ir, OptLevel level)
+    {
+        auto ctx = std::make_unique<LLVMContext>();
+        auto m = compileIR(ir, *ctx);
+        setLevel(*m, level);
+
+        SymbolLookupSet symbols;
+        for (auto &global : m->global_values())
+            if (!global.isDeclaration())
+                symbols.add(JIT->mangleAndIntern(global.getName()));
+
+        addModule(ThreadSafeModule(std::move(m), std::move(ctx)));
+        JIT->getExecutionSession().lookup(LookupKind::Static,
+            makeJITDylibSearchOrder(&JIT->getMainJITDylib()),
+            std::move(symbols), SymbolState::Ready,
+            [](Expected<SymbolMap> result) {
+                if (!result)
+                    logAllUnhandledErrors(result.takeError(), errs(), "JIT: ");
+            },
+            NoDependenciesToRegister);
     }
 
     /*
@@ -108,67 +295,460 @@ public:
      * not added as a global definition.
      */
     void
-    executeIR (std::string name, std::string ir)
+    executeIR (std::string name, std::string ir, OptLevel level)
     {
-        auto m = compileIR(ir);
-        auto k = addModule(std::move(m));
+        auto m = CloneModule(*declarations);
+        parseInto(ir, *m);
+        setLevel(*m, level);
+
+        auto tracker = JIT->getMainJITDylib().createResourceTracker();
+        addModule(ThreadSafeModule(std::move(m), context), tracker);
 
         auto func = findSymbol(name);
-        if (!func) {
-            errs() << "Couldn't find procedure `" + name + "`!\n";
+        if (func) {
+            auto entry = (FunctionEntry) func;
+            entry();
+        }
+        cantFail(tracker->remove());
+    }
+
+    /*
+     * Build the body into a new function for the procedure `symbol` and
+     * point the procedure's stub at it, returning the stub. Each function
+     * is named after its procedure and numbered, as the procedure's old
+     * functions can't be removed while they may still be running.
+     */
+    void*
+    compileFunction (std::string symbol, const NativeBody& body,
+            OptLevel level)
+    {
+        std::string name = symbol + "#" + std::to_string(functions++);
+        auto ctx = std::make_unique<LLVMContext>();
+        auto m = std::make_unique<Module>(name, *ctx);
+        m->setDataLayout(JIT->getDataLayout());
+
+        Codegen codegen(*m, body,
+                [this](uint64_t a) { return address(a); });
+        if (!codegen.procedure(name))
+            return NULL;
+        setLevel(*m, level);
+        if (dump)
+            m->print(errs(), nullptr);
+        if (verifyModule(*m, &errs()))
+            return NULL;
+
+        stub(symbol);
+        for (auto &callee : body.callees)
+            stub(callee.second);
+
+        addModule(ThreadSafeModule(std::move(m), std::move(ctx)));
+        void *function = findSymbol(name);
+        if (!function)
+            return NULL;
+
+        std::lock_guard<std::mutex> lock(swapLock);
+        generations[symbol]++;
+        unmerged[symbol] = (JITTargetAddress) function;
+        cantFail(stubs->updatePointer(symbol, (JITTargetAddress) function));
+        dissolve(symbol);
+        return (void*) stubs->findStub(symbol, true).getAddress();
+    }
+
+    /* Point the stub of the procedure `symbol`, if any, at the interpreter */
+    void
+    interpret (std::string symbol)
+    {
+        std::lock_guard<std::mutex> lock(swapLock);
+        generations[symbol]++;
+        unmerged.erase(symbol);
+        if (stubs->findStub(symbol, true))
+            cantFail(stubs->updatePointer(symbol, interpreter));
+        dissolve(symbol);
+    }
+
+    /*
+     * Build the cluster of `bodies` rooted at `root` into one module. The
+     * root gets a numbered function as compileFunction would give it, while
+     * the other members are private to the module under their own symbol, so
+     * that calls to them no longer go through their stub. The module is
+     * compiled on the pool and the root's stub repointed when it is done.
+     */
+    void
+    compileCluster (std::string root,
+            const std::map<std::string, NativeBody>& bodies, OptLevel level)
+    {
+        std::string name = root + "#" + std::to_string(functions++);
+        auto ctx = std::make_unique<LLVMContext>();
+        auto m = std::make_unique<Module>(name, *ctx);
+        m->setDataLayout(JIT->getDataLayout());
+
+        auto addresses = [this](uint64_t a) { return address(a); };
+        if (!Codegen(*m, bodies.at(root), addresses).procedure(name))
             return;
+        for (auto &member : bodies) {
+            if (member.first == root)
+                continue;
+            /* a member which can't be built is still called via its stub */
+            if (!Codegen(*m, member.second, addresses).procedure(member.first))
+                continue;
+            m->getFunction(member.first)->setLinkage(
+                    GlobalValue::InternalLinkage);
         }
+        setLevel(*m, level);
+        if (dump)
+            m->print(errs(), nullptr);
+        if (verifyModule(*m, &errs()))
+            return;
+
+        for (auto &member : bodies)
+            for (auto &callee : member.second.callees)
+                stub(callee.second);
 
-        auto entry = (FunctionEntry) (intptr_t) cantFail(func.getAddress());
-        entry();
+        std::map<std::string, unsigned long> seen;
+        {
+            std::lock_guard<std::mutex> lock(swapLock);
+            for (auto &member : bodies)
+                seen[member.first] = generations[member.first];
+            pending++;
+        }
 
-        removeModule(k);
+        addModule(ThreadSafeModule(std::move(m), std::move(ctx)));
+        auto symbol = JIT->mangleAndIntern(name);
+        JIT->getExecutionSession().lookup(LookupKind::Static,
+            makeJITDylibSearchOrder(&JIT->getMainJITDylib()),
+            SymbolLookupSet(symbol), SymbolState::Ready,
+            [this, root, seen, symbol](Expected<SymbolMap> result) {
+                std::lock_guard<std::mutex> lock(swapLock);
+                if (!result)
+                    logAllUnhandledErrors(result.takeError(), errs(), "JIT: ");
+                else if (current(seen)) {
+                    cantFail(stubs->updatePointer(root,
+                            (*result)[symbol].getAddress()));
+                    clusters[root].clear();
+                    for (auto &member : seen)
+                        clusters[root].insert(member.first);
+                }
+                pending--;
+                settled.notify_all();
+            },
+            NoDependenciesToRegister);
+    }
+
+    /* Wait for every cluster being compiled */
+    void
+    settle ()
+    {
+        std::unique_lock<std::mutex> lock(swapLock);
+        settled.wait(lock, [this]() { return pending == 0; });
+    }
+
+    unsigned long
+    getClusters ()
+    {
+        std::lock_guard<std::mutex> lock(swapLock);
+        return clusters.size();
     }
 
     unsigned long*
     getStack ()
     {
-        auto stack = findSymbol("stack");
-        if (!stack) {
-            errs() << "Couldn't find stack!\n";
-            return NULL;
+        return (unsigned long*) findSymbol("stack");
+    }
+
+    unsigned char*
+    getTypes ()
+    {
+        return (unsigned char*) findSymbol("types");
+    }
+
+    DiskCache&
+    getCache ()
+    {
+        return cache;
+    }
+
+    /*
+     * Build the procedures in `bodies`, by symbol, into a program which runs
+     * `entry` on a data stack of its own, defined by `globals`. Everything
+     * is in one module so the procedures may be inlined into each other, and
+     * everything but `main` is internal. The program is written to `path` as
+     * an object if it ends in ".o", otherwise as an executable linked by the
+     * system's C compiler.
+     */
+    bool
+    buildProgram (const std::map<std::string, NativeBody> &bodies,
+                  std::string entry,
+                  std::string globals,
+                  std::string path)
+    {
+        auto builder = cantFail(JITTargetMachineBuilder::detectHost());
+        builder.setRelocationModel(Reloc::PIC_);
+        builder.setCodeGenOptLevel(CodeGenOpt::Aggressive);
+        auto TM = builder.createTargetMachine();
+        if (!TM) {
+            logAllUnhandledErrors(TM.takeError(), errs(), "Build: ");
+            return false;
+        }
+
+        LLVMContext ctx;
+        Module M("program", ctx);
+        M.setDataLayout((*TM)->createDataLayout());
+        M.setTargetTriple((*TM)->getTargetTriple().str());
+        parseInto(globals, M);
+        parseInto(PROGRAM_HOOKS, M);
+
+        std::map<uint64_t, std::string> names;
+        std::set<uint64_t> limits;
+        for (auto &body : bodies)
+            limits.insert((uint64_t) body.second.limit);
+        auto address = [&](uint64_t a) {
+            return programAddress(M, names, limits, a);
+        };
+
+        for (auto &body : bodies) {
+            Codegen codegen(M, body.second, address);
+            if (!codegen.procedure(body.first)) {
+                errs() << "Build: cannot compile `" << body.first << "'\n";
+                return false;
+            }
         }
 
-        return (unsigned long*) cantFail(stack.getAddress());
+        linkRuntime(M, GlobalValue::ExternalLinkage);
+        for (auto &F : M)
+            if (!F.isDeclaration())
+                F.setLinkage(GlobalValue::InternalLinkage);
+        programEntry(M, entry);
+
+        if (verifyModule(M, &errs()))
+            return false;
+        optimizeModule(M, OPT_AGGRESSIVE, TM->get());
+        if (dump)
+            M.print(errs(), nullptr);
+
+        bool object = StringRef(path).endswith(".o");
+        std::string file = object ? path : path + ".o";
+        if (!emitObject(M, **TM, file))
+            return false;
+        if (object)
+            return true;
+
+        bool linked = link(file, path);
+        sys::fs::remove(file);
+        return linked;
+    }
+
+    void
+    setTimePasses (bool time)
+    {
+        timing = time;
+    }
+
+    std::map<std::string, double>
+    getPassTimes ()
+    {
+        std::lock_guard<std::mutex> guard(timesLock);
+        return times;
     }
 
 private:
-    VModuleKey
-    addModule (std::unique_ptr<Module> M)
+    /* Optimize the module, unless its object is already in the cache */
+    void
+    transform (Module &M)
     {
-        // Add the module to the JIT with a new VModuleKey.
-        auto K = ES.allocateVModule();
-        cantFail(OptimizeLayer.addModule(K, std::move(M)));
-        return K;
+        OptLevel level = getLevel(M);
+        if (cache.enabled()) {
+            std::string key = DiskCache::key(M, configuration(level));
+            DiskCache::setKey(M, key);
+            if (cache.fetch(key))
+                return;
+        }
+        linkRuntime(M, GlobalValue::AvailableExternallyLinkage);
+        optimizeModule(M, level);
+    }
+
+    /*
+     * Read the runtime's bitcode and define its helpers in the JIT for the
+     * calls to them which aren't inlined.
+     */
+    void
+    loadRuntime ()
+    {
+        runtime = MemoryBuffer::getMemBuffer(
+                StringRef((const char*) RUNTIME, sizeof(RUNTIME)),
+                "runtime", false);
+
+        SHA1 hash;
+        hash.update(runtime->getBuffer());
+        runtimeHash = toHex(hash.final(), true);
+
+        auto ctx = std::make_unique<LLVMContext>();
+        auto m = cantFail(parseBitcodeFile(runtime->getMemBufferRef(), *ctx));
+        m->setDataLayout(JIT->getDataLayout());
+        m->setTargetTriple(JIT->getTargetTriple().str());
+        for (auto &F : *m)
+            if (!F.isDeclaration())
+                helpers.insert(F.getName().str());
+        addModule(ThreadSafeModule(std::move(m), std::move(ctx)));
     }
 
+    /*
+     * Link the helpers the module calls into it, defined with `linkage`.
+     * Every module has a context of its own, which a module parsed once
+     * can't be cloned into, so the bitcode is read into the module's
+     * context lazily: only the helpers it calls, and theirs, are parsed, and
+     * nothing at all for a module which calls none.
+     */
     void
-    removeModule (VModuleKey K)
+    linkRuntime (Module &M, GlobalValue::LinkageTypes linkage)
+    {
+        bool needed = false;
+        for (auto &F : M)
+            if (F.isDeclaration() && helpers.count(F.getName().str()))
+                needed = true;
+        if (!needed)
+            return;
+
+        auto library = cantFail(getLazyBitcodeModule(
+                    runtime->getMemBufferRef(), M.getContext()));
+        library->setDataLayout(M.getDataLayout());
+        library->setTargetTriple(M.getTargetTriple());
+        for (auto &F : *library)
+            if (!F.isDeclaration())
+                F.setLinkage(linkage);
+        if (Linker::linkModules(M, std::move(library),
+                    Linker::LinkOnlyNeeded))
+            errs() << "JIT: cannot link the runtime into " << M.getName()
+                << "\n";
+    }
+
+    /* Leave the level to optimize the module at in the module */
+    static void
+    setLevel (Module &M, OptLevel level)
     {
-        cantFail(OptimizeLayer.removeModule(K));
+        LLVMContext &ctx = M.getContext();
+        NamedMDNode *node = M.getOrInsertNamedMetadata("scribble.opt");
+        node->clearOperands();
+        node->addOperand(MDNode::get(ctx, ConstantAsMetadata::get(
+            ConstantInt::get(Type::getInt32Ty(ctx), level))));
     }
 
-    JITSymbol
-    findSymbol(const std::string Name)
+    static OptLevel
+    getLevel (const Module &M)
     {
-        return OptimizeLayer.findSymbol(mangle(Name), true);
+        NamedMDNode *node = M.getNamedMetadata("scribble.opt");
+        if (!node || node->getNumOperands() == 0)
+            return OPT_DEFAULT;
+        return (OptLevel) mdconst::extract<ConstantInt>(
+            node->getOperand(0)->getOperand(0))->getZExtValue();
+    }
+
+    /* What, besides its IR, the object of a module depends on */
+    std::string
+    configuration (OptLevel opt)
+    {
+        return "\n; target " + JIT->getTargetTriple().str()
+            + " codegen -O" + std::to_string((int) level)
+            + " passes -O" + std::to_string((int) opt)
+            + " runtime " + runtimeHash + "\n";
+    }
+
+    /*
+     * The symbol standing for `address` in native code, defined as the
+     * address itself the first time it is needed.
+     */
+    std::string
+    address (uint64_t address)
+    {
+        auto iter = addresses.find(address);
+        if (iter != addresses.end())
+            return iter->second;
+
+        std::string name = "address." + std::to_string(addresses.size());
+        cantFail(JIT->getMainJITDylib().define(absoluteSymbols({
+            { JIT->mangleAndIntern(name),
+                JITEvaluatedSymbol(address, JITSymbolFlags::Exported) }
+        })));
+        addresses[address] = name;
+        return name;
+    }
+
+    /* Whether no procedure was repointed since its generation was `seen` */
+    bool
+    current (const std::map<std::string, unsigned long>& seen)
+    {
+        for (auto &member : seen)
+            if (generations[member.first] != member.second)
+                return false;
+        return true;
+    }
+
+    /*
+     * The procedure `symbol` was just repointed, so the clusters it belongs
+     * to are out of date. Their roots, but for `symbol` itself, go back to
+     * their own function. Needs `swapLock`.
+     */
+    void
+    dissolve (const std::string& symbol)
+    {
+        for (auto iter = clusters.begin(); iter != clusters.end(); ) {
+            if (!iter->second.count(symbol)) {
+                iter++;
+                continue;
+            }
+            if (iter->first != symbol)
+                cantFail(stubs->updatePointer(iter->first,
+                        unmerged.at(iter->first)));
+            iter = clusters.erase(iter);
+        }
+    }
+
+    /* Create the stub for the procedure `symbol` unless it exists */
+    void
+    stub (const std::string &symbol)
+    {
+        if (stubs->findStub(symbol, true))
+            return;
+
+        if (!interpreter)
+            interpreter = (JITTargetAddress) findSymbol("machine_call");
+
+        auto flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+        cantFail(stubs->createStub(symbol, interpreter, flags));
+        cantFail(JIT->getMainJITDylib().define(absoluteSymbols({
+            { JIT->mangleAndIntern(symbol), stubs->findStub(symbol, true) }
+        })));
+    }
+
+    void
+    addModule (ThreadSafeModule M, ResourceTrackerSP RT = nullptr)
+    {
+        if (RT)
+            cantFail(JIT->addIRModule(RT, std::move(M)));
+        else
+            cantFail(JIT->addIRModule(std::move(M)));
+    }
+
+    /* Look up `Name`, waiting for it to be compiled, or NULL */
+    void*
+    findSymbol (const std::string Name)
+    {
+        auto Sym = JIT->lookup(Name);
+        if (!Sym) {
+            logAllUnhandledErrors(Sym.takeError(), errs(), "JIT: ");
+            return NULL;
+        }
+        return (void*) Sym->getAddress();
     }
 
     std::unique_ptr<Module>
-    compileIR (std::string IR)
+    compileIR (std::string IR, LLVMContext &ctx)
     {
         SMDiagnostic errhandler;
 
-        /* TODO: debug mode to output this stuff */
-        //printf("IR:\n%s\n", IR.c_str());
+        if (dump)
+            errs() << IR;
 
-        std::unique_ptr<MemoryBuffer> IRbuff = MemoryBuffer::getMemBuffer(IR);
-        auto m = parseIR(*IRbuff, errhandler, context);
+        auto m = parseIR(MemoryBufferRef(IR, "module"), errhandler, ctx);
         if (!m) {
             errhandler.print("JIT", errs());
             exit(1);
@@ -176,64 +756,347 @@ private:
         return m;
     }
 
-    std::string
-    mangle (const std::string &Name)
+    /*
+     * Parse IR into an existing module, so that it may refer to what is
+     * already declared there without the declarations being parsed again.
+     */
+    void
+    parseInto (std::string IR, Module &M)
     {
-        std::string MangledName;
-        raw_string_ostream MangledNameStream(MangledName);
-        Mangler::getNameWithPrefix(MangledNameStream, Name, DL);
-        return MangledNameStream.str();
+        SMDiagnostic errhandler;
+
+        if (dump)
+            errs() << IR;
+
+        if (parseAssemblyInto(MemoryBufferRef(IR, M.getName()), &M, nullptr,
+                    errhandler)) {
+            errhandler.print("JIT", errs());
+            exit(1);
+        }
     }
 
-    std::unique_ptr<Module>
-    optimizeModule (std::unique_ptr<Module> M)
+    /*
+     * Define the symbol standing for `address` in a program. The end of the
+     * Machine's stack becomes the end of the program's, and a string or
+     * symbol becomes a copy of it in the program, tagged as it was.
+     */
+    static std::string
+    programAddress (Module &M,
+                    std::map<uint64_t, std::string> &names,
+                    const std::set<uint64_t> &limits,
+                    uint64_t address)
+    {
+        auto iter = names.find(address);
+        if (iter != names.end())
+            return iter->second;
+
+        LLVMContext &ctx = M.getContext();
+        Type *byte = Type::getInt8Ty(ctx);
+        Type *bytes = Type::getInt8PtrTy(ctx);
+        std::string name = "address." + std::to_string(names.size());
+        Constant *aliasee;
+
+        if (limits.count(address)) {
+            GlobalVariable *stack = M.getNamedGlobal("stack");
+            uint64_t size = stack->getValueType()->getArrayNumElements();
+            aliasee = ConstantExpr::getBitCast(ConstantExpr::getGetElementPtr(
+                stack->getValueType(), stack,
+                ArrayRef<Constant*>({ ConstantInt::get(Type::getInt64Ty(ctx), 0),
+                    ConstantInt::get(Type::getInt64Ty(ctx), size) })), bytes);
+        }
+        else {
+            Data data;
+            data.word = address;
+            uint64_t tag = address & Data::TAG_MASK;
+            const std::string &s = tag == Data::TAG_STRING ? data.string()
+                : data.symbol();
+
+            auto *string = new GlobalVariable(M,
+                ArrayType::get(byte, s.size() + 1), true,
+                GlobalValue::PrivateLinkage,
+                ConstantDataArray::getString(ctx, s), "string");
+            string->setAlignment(Align(8));
+            aliasee = ConstantExpr::getGetElementPtr(byte,
+                ConstantExpr::getBitCast(string, bytes),
+                ConstantInt::get(Type::getInt64Ty(ctx), tag));
+        }
+
+        GlobalAlias::create(byte, 0, GlobalValue::PrivateLinkage, name,
+                aliasee, &M);
+        names[address] = name;
+        return name;
+    }
+
+    /* Define `main`, which runs the procedure `entry` from the stack's base */
+    static void
+    programEntry (Module &M, const std::string &entry)
+    {
+        LLVMContext &ctx = M.getContext();
+        IRBuilder<> builder(ctx);
+        Function *main = Function::Create(
+            FunctionType::get(builder.getInt32Ty(), false),
+            Function::ExternalLinkage, "main", M);
+        builder.SetInsertPoint(BasicBlock::Create(ctx, "entry", main));
+
+        GlobalVariable *stack = M.getNamedGlobal("stack");
+        Value *base = builder.CreateConstInBoundsGEP2_64(
+            stack->getValueType(), stack, 0, 0);
+        builder.CreateStore(base, M.getNamedGlobal("top"));
+        builder.CreateCall(M.getFunction(entry), { base,
+            ConstantPointerNull::get(builder.getInt8PtrTy()),
+            builder.getInt64(0) });
+        builder.CreateRet(builder.getInt32(0));
+    }
+
+    static bool
+    emitObject (Module &M, TargetMachine &TM, const std::string &file)
+    {
+        std::error_code EC;
+        raw_fd_ostream out(file, EC, sys::fs::OF_None);
+        if (EC) {
+            errs() << "Build: " << file << ": " << EC.message() << "\n";
+            return false;
+        }
+
+        legacy::PassManager PM;
+        if (TM.addPassesToEmitFile(PM, out, nullptr, CGFT_ObjectFile)) {
+            errs() << "Build: cannot emit an object for this target\n";
+            return false;
+        }
+        PM.run(M);
+        return true;
+    }
+
+    /* Link the object `file` into the executable `path` with `cc` */
+    static bool
+    link (const std::string &file, const std::string &path)
+    {
+        auto cc = sys::findProgramByName("cc");
+        if (!cc) {
+            errs() << "Build: cannot find cc to link with\n";
+            return false;
+        }
+
+        std::string message;
+        StringRef argv[] = { "cc", file, "-o", path };
+        if (sys::ExecuteAndWait(*cc, argv, None, {}, 0, 0, &message) != 0) {
+            errs() << "Build: linking failed " << message << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    /*
+     * Run the new pass manager's pipeline for `level` over the module. The
+     * O0 pipeline leaves code which is run once as it is, apart from what
+     * must always be inlined.
+     */
+    void
+    optimizeModule (Module &M, OptLevel level, TargetMachine *TM = nullptr)
     {
-        // Create a function pass manager.
-        auto FPM = std::make_unique<legacy::FunctionPassManager>(M.get());
+        LoopAnalysisManager LAM;
+        FunctionAnalysisManager FAM;
+        CGSCCAnalysisManager CGAM;
+        ModuleAnalysisManager MAM;
+        PassInstrumentationCallbacks PIC;
 
-        // Add some optimizations.
-        FPM->add(createInstructionCombiningPass());
-        FPM->add(createReassociatePass());
-        FPM->add(createGVNPass());
-        FPM->add(createCFGSimplificationPass());
-        FPM->doInitialization();
+        std::map<std::string, double> spent;
+        std::vector<std::chrono::steady_clock::time_point> started;
+        if (timing)
+            time(PIC, spent, started);
 
-        // Run the optimizations over all functions in the module being added
-        // to the JIT.
-        for (auto &F : *M)
-            FPM->run(F);
+        PassBuilder PB(TM, PipelineTuningOptions(), None, &PIC);
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
 
-        return M;
+        ModulePassManager MPM;
+        switch (level) {
+            case OPT_NONE:
+                MPM = PB.buildO0DefaultPipeline(OptimizationLevel::O0);
+                break;
+            case OPT_LESS:
+                MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O1);
+                break;
+            case OPT_DEFAULT:
+                MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O2);
+                break;
+            case OPT_AGGRESSIVE:
+                MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3);
+                break;
+        }
+        MPM.run(M, MAM);
+
+        if (timing) {
+            std::lock_guard<std::mutex> guard(timesLock);
+            for (auto &pass : spent)
+                times[pass.first] += pass.second;
+        }
+    }
+
+    /*
+     * Sum the time spent in each pass run with `PIC` into `spent`. Pass
+     * managers and adaptors only run other passes so they aren't timed.
+     */
+    static void
+    time (PassInstrumentationCallbacks &PIC,
+          std::map<std::string, double> &spent,
+          std::vector<std::chrono::steady_clock::time_point> &started)
+    {
+        auto timed = [](StringRef pass) {
+            return !isSpecialPass(pass, { "PassManager", "PassAdaptor",
+                "AnalysisManagerProxy" });
+        };
+
+        PIC.registerBeforeNonSkippedPassCallback(
+            [&started, timed](StringRef pass, Any) {
+                if (timed(pass))
+                    started.push_back(std::chrono::steady_clock::now());
+            });
+        auto after = [&spent, &started, timed](StringRef pass) {
+            if (!timed(pass))
+                return;
+            std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - started.back();
+            started.pop_back();
+            spent[pass.str()] += elapsed.count();
+        };
+        PIC.registerAfterPassCallback(
+            [after](StringRef pass, Any, const PreservedAnalyses&) {
+                after(pass);
+            });
+        PIC.registerAfterPassInvalidatedCallback(
+            [after](StringRef pass, const PreservedAnalyses&) {
+                after(pass);
+            });
     }
 };
 
-LLVM::LLVM ()
+/* The number of LLVM instances alive, of which there may only be one */
+static unsigned counter = 0;
+
+LLVM::LLVM (unsigned threads)
 {
-    static unsigned counter = 0;
     assert(counter == 0);
     counter++;
 
+    if (threads == 0)
+        threads = std::max(1U, std::thread::hardware_concurrency());
+
     llvm::InitializeNativeTarget();
     llvm::InitializeNativeTargetAsmParser();
     llvm::InitializeNativeTargetAsmPrinter();
-    this->context = (void*) new LLVMJIT();
+    this->context = (void*) new LLVMJIT(threads);
 }
 
 LLVM::~LLVM ()
 {
     delete (LLVMJIT*) this->context;
+    counter--;
+}
+
+void
+LLVM::declare (std::string ir)
+{
+    ((LLVMJIT*) this->context)->declare(ir);
+}
+
+void
+LLVM::defineIR (std::string ir, OptLevel level)
+{
+    ((LLVMJIT*) this->context)->defineIR(ir, level);
+}
+
+void
+LLVM::execute (std::string name, std::string ir, OptLevel level)
+{
+    ((LLVMJIT*) this->context)->executeIR(name, ir, level);
+}
+
+void*
+LLVM::compile (std::string name, const NativeBody& body, OptLevel level)
+{
+    return ((LLVMJIT*) this->context)->compileFunction(name, body, level);
+}
+
+void
+LLVM::interpret (std::string name)
+{
+    ((LLVMJIT*) this->context)->interpret(name);
 }
 
 void
-LLVM::defineIR (std::string ir)
+LLVM::cluster (std::string root,
+               const std::map<std::string, NativeBody>& bodies,
+               OptLevel level)
 {
-    ((LLVMJIT*) this->context)->defineIR(ir);
+    ((LLVMJIT*) this->context)->compileCluster(root, bodies, level);
 }
 
 void
-LLVM::execute (std::string name, std::string ir)
+LLVM::settle ()
 {
-    ((LLVMJIT*) this->context)->executeIR(name, ir);
+    ((LLVMJIT*) this->context)->settle();
+}
+
+unsigned long
+LLVM::getClusters ()
+{
+    return ((LLVMJIT*) this->context)->getClusters();
+}
+
+bool
+LLVM::setCache (std::string directory, unsigned long capacity)
+{
+    return ((LLVMJIT*) this->context)->getCache().open(directory, capacity);
+}
+
+void
+LLVM::clearCache ()
+{
+    ((LLVMJIT*) this->context)->getCache().clear();
+}
+
+unsigned long
+LLVM::getCacheHits ()
+{
+    return ((LLVMJIT*) this->context)->getCache().getHits();
+}
+
+unsigned long
+LLVM::getCacheMisses ()
+{
+    return ((LLVMJIT*) this->context)->getCache().getMisses();
+}
+
+bool
+LLVM::build (const std::map<std::string, NativeBody>& bodies,
+             std::string entry,
+             std::string globals,
+             std::string path)
+{
+    return ((LLVMJIT*) this->context)->buildProgram(bodies, entry, globals,
+            path);
+}
+
+void
+LLVM::setTimePasses (bool time)
+{
+    ((LLVMJIT*) this->context)->setTimePasses(time);
+}
+
+std::map<std::string, double>
+LLVM::getPassTimes ()
+{
+    return ((LLVMJIT*) this->context)->getPassTimes();
+}
+
+void
+LLVM::setDump (bool dump)
+{
+    ((LLVMJIT*) this->context)->setDump(dump);
 }
 
 unsigned long*
@@ -241,3 +1104,9 @@ LLVM::getStack ()
 {
     return ((LLVMJIT*) this->context)->getStack();
 }
+
+unsigned char*
+LLVM::getTypes ()
+{
+    return ((LLVMJIT*) this->context)->getTypes();
+}
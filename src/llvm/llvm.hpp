@@ -2,20 +2,102 @@
 #define SCRIBBLE_LLVM
 
 #include <string>
+#include <map>
+#include "tier.hpp"
+
+/*
+ * How hard the JIT optimizes a module, from barely at all for code which is
+ * run once to the full O3 pipeline, with inlining and loop passes, for code
+ * which is hot or compiled ahead of time.
+ */
+typedef enum {
+    OPT_NONE,
+    OPT_LESS,
+    OPT_DEFAULT,
+    OPT_AGGRESSIVE
+} OptLevel;
 
 class LLVM
 {
 public:
-    LLVM ();
+    /* Compile on a pool of `threads`, by default one per core */
+    LLVM (unsigned threads = 0);
     ~LLVM ();
 
+    /* Parse declarations into the module every later module starts from */
+    void declare (std::string ir);
+
     /* Compile and add the IR to the global list of definitions */
-    void defineIR (std::string ir);
+    void defineIR (std::string ir, OptLevel level = OPT_DEFAULT);
 
     /* Compile and execute IR and then execute the function `name` */
-    void execute (std::string name, std::string ir);
+    void execute (std::string name,
+                  std::string ir,
+                  OptLevel level = OPT_NONE);
+
+    /*
+     * Build `body` into a function for the procedure `name` and point the
+     * procedure's stub at it, returning the stub.
+     */
+    void* compile (std::string name,
+                   const NativeBody& body,
+                   OptLevel level = OPT_DEFAULT);
+
+    /* Point the stub of the procedure `name` back at the interpreter */
+    void interpret (std::string name);
+
+    /*
+     * Build the procedures in `bodies`, by symbol, into one module in the
+     * background, calling each other directly so that they may be inlined,
+     * and point the stub of `root` at the result once it is compiled unless
+     * one of them was compiled again or interpreted in the meantime.
+     */
+    void cluster (std::string root,
+                  const std::map<std::string, NativeBody>& bodies,
+                  OptLevel level = OPT_DEFAULT);
+
+    /* Wait until no cluster is being compiled */
+    void settle ();
+
+    /* The number of stubs which lead to a cluster */
+    unsigned long getClusters ();
+
+    /*
+     * Build the procedures in `bodies`, by symbol, with the `globals` they
+     * share into an executable, or an object if `path` ends in ".o", whose
+     * `main` runs the procedure `entry`.
+     */
+    bool build (const std::map<std::string, NativeBody>& bodies,
+                std::string entry,
+                std::string globals,
+                std::string path);
+
+    /*
+     * Keep compiled objects in `directory` across runs, removing the least
+     * recently used once they take more than `capacity` bytes. Returns false
+     * if the directory can't be created.
+     */
+    bool setCache (std::string directory, unsigned long capacity);
+
+    /* Remove every object from the cache */
+    void clearCache ();
+
+    /* How many modules were, and weren't, found in the cache */
+    unsigned long getCacheHits ();
+    unsigned long getCacheMisses ();
+
+    /*
+     * Time every pass run from now on. The times are in seconds, summed by
+     * pass over every module.
+     */
+    void setTimePasses (bool time);
+    std::map<std::string, double> getPassTimes ();
+
+    /* Print every module to stderr before it is compiled */
+    void setDump (bool dump);
 
     unsigned long* getStack ();
+    unsigned char* getTypes ();
 
 private:
     void *context;
@@ -0,0 +1,66 @@
+; The runtime's helpers. This is assembled to bitcode when scribble is built,
+; embedded in the binary and linked into every module the JIT compiles which
+; uses a helper, with available_externally linkage so that the optimizer may
+; inline it. The JIT also defines them once for calls which aren't inlined.
+;
+; Helpers small enough that a call would cost more than their body are always
+; inlined, even into code which is run once and otherwise left unoptimized.
+;
+; There are no helpers for strings. A string on the stack points at the
+; Machine's own std::string, which native code has no business reading, and
+; nothing native builds strings; the one thing done with them, printing,
+; goes through scribble_print.
+
+@stack = external global [4096 x i64]
+@types = external global [4096 x i8]
+
+@.integer = private unnamed_addr constant [5 x i8] c"%lu\0A\00"
+
+declare i32 @printf(i8*, ...)
+declare void @machine_print(i8*, i64*)
+
+; Write `word` to the top of the stack, returning the new top
+define i64* @scribble_push(i64* %top, i64 %word) alwaysinline {
+    store i64 %word, i64* %top, align 8
+    %next = getelementptr inbounds i64, i64* %top, i64 1
+    ret i64* %next
+}
+
+; Clear the top of the stack and its type, as the Machine does when it pops,
+; returning the new top
+define i64* @scribble_pop(i64* %top) alwaysinline {
+    %slot = getelementptr inbounds i64, i64* %top, i64 -1
+    call void @scribble_tag(i64* %slot, i8 0)
+    store i64 0, i64* %slot, align 8
+    ret i64* %slot
+}
+
+; Write `type` to the byte of @types for the value at `slot`
+define void @scribble_tag(i64* %slot, i8 %type) alwaysinline {
+    %address = ptrtoint i64* %slot to i64
+    %offset = sub i64 %address, ptrtoint ([4096 x i64]* @stack to i64)
+    %index = ashr exact i64 %offset, 3
+    %byte = getelementptr inbounds [4096 x i8], [4096 x i8]* @types, i64 0, i64 %index
+    store i8 %type, i8* %byte, align 1
+    ret void
+}
+
+; Print the top of the stack as Data::print does. Integers are printed here,
+; anything else by the Machine, which knows how strings are kept.
+define void @scribble_print(i8* %machine, i64* %top) {
+    %slot = getelementptr inbounds i64, i64* %top, i64 -1
+    %word = load i64, i64* %slot, align 8
+    %low = and i64 %word, 1
+    %integer = icmp ne i64 %low, 0
+    br i1 %integer, label %unboxed, label %boxed
+
+unboxed:
+    %n = lshr i64 %word, 1
+    %format = getelementptr inbounds [5 x i8], [5 x i8]* @.integer, i64 0, i64 0
+    call i32 (i8*, ...) @printf(i8* %format, i64 %n)
+    ret void
+
+boxed:
+    call void @machine_print(i8* %machine, i64* %top)
+    ret void
+}
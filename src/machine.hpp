@@ -2,35 +2,143 @@
 #define SCRIBBLE_MACHINE
 
 #include <vector>
-#include <queue>
-#include <stack>
 #include <map>
+#include <set>
+#include <pthread.h>
 
 #include "definitions.hpp"
+#include "code.hpp"
 #include "error.hpp"
+#include "heap.hpp"
 #include "procedure.hpp"
 #include "stack.hpp"
+#include "tier.hpp"
+#include "verifier.hpp"
+
+/*
+ * A predecoded instruction for the threaded loop: the address of the handler
+ * implementing its operator and a pointer to the instruction in the reserved
+ * stack.
+ */
+struct Threaded
+{
+    const void *handler;
+    const Bytecode *bc;
+};
+
+/*
+ * A call instruction's operand indexes one of these. The callee is resolved
+ * to a procedure id when the caller is defined and its entry point is cached
+ * along with the version of the callee it was read from. Redefining the
+ * callee bumps its version, which makes the cache refill on the next call.
+ */
+struct CallSite
+{
+    unsigned long id;
+    unsigned long version;
+    unsigned long entry;
+    unsigned long nargs;
+
+    /* room the callee needs on the stack beyond its arguments */
+    unsigned long reserve;
+
+    /*
+     * The arity the caller, the code in [from, to), was verified against.
+     * While the callee matches it the call is `safe` and its arguments need
+     * not be counted.
+     */
+    Arity assumed;
+    bool safe;
+    unsigned long from;
+    unsigned long to;
+
+    /* the callee's native code, if it has been promoted */
+    NativeProcedure native;
+};
+
+/*
+ * An ancestor's operator emitted in place of a call to it. The call site is
+ * created up front so the instruction can be patched back into a call.
+ */
+struct InlineSite
+{
+    unsigned long address;
+    unsigned long site;
+};
+
+/*
+ * The value of a FOLD instruction and the address just past the instructions
+ * it stands in for. It stops being valid once a procedure it depends on is
+ * redefined.
+ */
+struct FoldSite
+{
+    Data value;
+    unsigned long target;
+    bool valid;
+};
+
+/* Calls the Machine may make while evaluating a fold */
+#define FOLD_FUEL 100000
+
+/* Calls and tail calls after which a procedure is compiled to native code */
+#define TIER_THRESHOLD 1000
+
+/* Native procedures a tier may merge into one cluster */
+#define CLUSTER_SIZE 8
+
+/*
+ * The C stack native code leaves free for the hooks it calls, and for the
+ * interpreter they run, between its checks of `machine_floor`.
+ */
+#define NATIVE_SLACK (1UL << 16)
+
+/* The lowest address native code may grow the C stack to */
+extern "C" char *machine_floor;
+
+/* The id of a name no procedure was ever referenced by */
+#define NO_PROCEDURE ((unsigned long) -1)
 
 class Machine
 {
 public:
-    Machine ()
-        : stack(Stack())
-        , registers(std::vector<Data>(REGCOUNT))
+    /* A verbose Machine prints what is defined, including its ancestors */
+    explicit Machine (bool verbose = true)
+        : stack()
+        , dispatch(DISPATCH_SWITCH)
+        , checked(false)
+        , verbose(verbose)
+        , tier(NULL)
+        , tierThreshold(TIER_THRESHOLD)
+        , fuel(0)
+        , bailed(false)
     {
+#ifdef SCRIBBLE_THREADED
+        /* Grab the handler addresses so procedures are predecoded on load */
+        runThreaded(0, true);
+        dispatch = DISPATCH_THREADED;
+#endif
+
         /*
-         * Define the ancestor procedures for our machine.
+         * A lone RET which calls made by CALLRET return to, so that the
+         * caller returns as soon as the callee does.
          */
+        retStub = heap.index();
+        heap.push(Bytecode(OP_RET));
+        predecode(retStub, retStub + 1);
 
-        defineProcedure("add", 2, std::queue<Bytecode>({
-            Bytecode(OP_ADD),
-            Bytecode(OP_RET)
-        }));
+        /* A lone HALT which evaluating a fold jumps to when it gives up */
+        haltStub = heap.index();
+        heap.push(Bytecode(OP_HALT));
+        predecode(haltStub, haltStub + 1);
+        heap.pin();
 
-        defineProcedure("print", 1, std::queue<Bytecode>({
-            Bytecode(OP_PRINT),
-            Bytecode(OP_RET)
-        }));
+        /*
+         * Define the ancestor procedures for our machine.
+         */
+
+        defineAncestor("add", 2, OP_ADD, true);
+        defineAncestor("print", 1, OP_PRINT, false);
     }
 
     Data
@@ -52,125 +160,494 @@ public:
     }
 
     /*
-     * Write the given instructions to the machine in the reserved part of the
-     * stack and define the entry to those instructions as a function.
+     * Write the given instructions to the machine's code heap and define
+     * the entry to those instructions as a function, whose old body is then
+     * dead. The procedure's constant pool is appended to the Machine's
+     * constants and the operands referring to it are relocated. Calls are
+     * resolved to procedure ids and given their own call site, and folds are
+     * registered with the procedures they depend on.
+     *
+     * The procedure is verified first. If that succeeds then the threaded
+     * loop runs it without the checks the verifier proved unnecessary, for
+     * as long as the procedures it calls keep the arity it assumed of them.
      */
     unsigned long
     defineProcedure (std::string name,
                      unsigned long nargs,
-                     std::queue<Bytecode> instructions)
+                     const Code& code,
+                     bool pure = false)
     {
-        unsigned long entry = stack.reserveIndex();
-        Data data;
+        unsigned long entry = heap.index();
+        uint64_t pool = constants.size();
+
+        for (const Primitive& constant : code.constants())
+            constants.push_back(intern(constant));
+
+        std::vector<Arity> arities = this->arities(code);
+        Verification verified = Verifier(code, nargs, arities).verify();
+        unsigned long end = entry + code.size();
+        grow(end);
+
+        if (verbose)
+            printf("| Defining `%s' at %lu%s\n", name.c_str(), entry,
+                    verified.ok ? " (verified)" : "");
+        for (unsigned long i = 0; i < code.size(); i++) {
+            Bytecode bc = code.instructions()[i];
+            if (verbose) {
+                printf(REPL_INFO_STR);
+                putchar('\t');
+                bc.print(code.constants());
+            }
 
-        printf("| Defining `%s' at %lu\n", name.c_str(), entry);
-        while (!instructions.empty()) {
-            Bytecode bc = instructions.front();
+            if (bc.op == OP_CALL || bc.op == OP_TAILCALL) {
+                bc.operand = callSite(code.constants()[bc.operand].atom());
+                assume(bc.operand, arities[i], verified.ok, entry, end);
+            }
+            else if (bc.op == OP_FOLD)
+                bc.operand = foldSite(code.folds()[bc.operand], entry);
+            else if (Bytecode::usesConstant(bc.op))
+                bc.operand += pool;
+            heap.push(bc);
+            _unchecked[entry + i] = verified.ok && verified.unchecked[i];
+        }
 
-            printf(REPL_INFO_STR);
-            putchar('\t');
-            bc.print();
+        for (auto& inlined : code.inlined()) {
+            Atom sym = code.constants()[inlined.second].atom();
+            InlineSite site = { entry + inlined.first, callSite(sym) };
+            assume(site.site, arities[inlined.first], verified.ok, entry, end);
+            inlineSites[procedureId(sym)].push_back(site);
+        }
 
-            data.assign(bc);
-            stack.reservePush(data);
-            instructions.pop();
+        predecode(entry, heap.index());
+
+        unsigned long id = procedureId(name);
+        heap.claim(id, entry, code.size());
+        if (ancestors.count(id))
+            uninline(id);
+        unfold(id);
+        link(id, code);
+
+        Procedure& proc = procedures[id];
+        bool hot = proc.getNative() != NULL;
+        proc.redefine(entry, code.size(), nargs, pure);
+        if (verified.ok) {
+            proc.verify(verified.returns, verified.depth);
+            depths[entry] = verified.depth;
         }
 
-        setProcedure(name, entry, nargs);
+        /*
+         * Native callers reach the procedure through its stub without
+         * checking what they assumed of it, so unverify them now if it no
+         * longer matches rather than on their next call.
+         */
+        for (unsigned long index : calleeSites[id]) {
+            const CallSite& site = callsites[index];
+            if (site.safe && !matches(site.assumed, proc))
+                unverify(site.from, site.to);
+        }
+        if (hot)
+            swap(id);
         return entry;
     }
 
+    /* Whether calls to `name` may be evaluated at compile time */
+    bool
+    pure (Atom name)
+    {
+        unsigned long id;
+        if (!findProcedure(name, id))
+            return false;
+        const Procedure& proc = procedures[id];
+        return proc.getVersion() > 0 && proc.isPure();
+    }
+
+    /* The number of arguments `name` takes, which must be defined */
+    unsigned long
+    numArgs (Atom name)
+    {
+        return getProcedure(name).getNumArgs();
+    }
+
     /*
-     * Get the entry point for a symbol.
+     * Evaluate a call to the procedure `name` with constant `args` on top of
+     * whatever is on the stack, with fuel: calls are counted but never make
+     * anything hot or run natively, and giving up leaves the Machine as it
+     * was. On success the value it returned is placed in `result` and the
+     * ids of the procedures the value depends on in `deps`. Procedures which
+     * print, make too many calls, or leave anything but a single value
+     * cannot be evaluated.
      */
+    bool
+    evaluate (Atom name,
+              const std::vector<Primitive>& args,
+              Primitive& result,
+              std::vector<unsigned long>& deps)
+    {
+        Code code;
+
+        for (const Primitive& arg : args) {
+            if (arg.type() == PRM_INTEGER)
+                code.emit(Bytecode(OP_PUSHINT, arg.integer()));
+            else
+                code.emit(Bytecode(OP_PUSHCONST, code.constant(arg)));
+        }
+        code.emit(Bytecode(OP_CALL,
+                    code.constant(Primitive(PRM_SYMBOL, name))));
+        code.emit(Bytecode(OP_HALT));
+
+        unsigned long start = stack.index();
+        unsigned long depth = stack.depth();
+        unsigned long pc = PC;
+        Data saved[REGCOUNT];
+        std::copy(registers, registers + REGCOUNT, saved);
+        bool loud = verbose;
+
+        verbose = false;
+        fuel = FOLD_FUEL;
+        bailed = false;
+        touched.clear();
+        execute(code);
+
+        bool known = !bailed && stack.index() == start + 1;
+        if (known)
+            result = stack.peek(0).toPrimitive();
+
+        stack.truncate(start);
+        stack.unwind(depth);
+        PC = pc;
+        std::copy(saved, saved + REGCOUNT, registers);
+        verbose = loud;
+        fuel = 0;
+        bailed = false;
+        if (!known)
+            return false;
+
+        /*
+         * Anything but an ancestor may have ancestors inlined into it, so
+         * the value then also depends on every ancestor.
+         */
+        bool ancestral = true;
+        for (unsigned long id : touched) {
+            deps.push_back(id);
+            if (!ancestors.count(id))
+                ancestral = false;
+        }
+        if (!ancestral) {
+            for (auto& ancestor : ancestors)
+                deps.push_back(ancestor.first);
+        }
+        return true;
+    }
+
+    /* The id folds of calls to `name` depend on */
     unsigned long
-    procedureEntry (std::string sym)
+    dependency (Atom name)
     {
-        return getProcedure(sym).entry;
+        return procedureId(name);
     }
 
     /*
-     * Execute the given instructions. The given instructions are treated as
-     * coming from a REPL. Thus we add them always to the top of the executable
-     * stack and execute them as a procedure.
+     * If `name` still refers to the ancestor the Machine defined, get the
+     * operator implementing it and its number of arguments so that calls to
+     * it may be emitted inline.
+     */
+    bool
+    ancestor (Atom name, Operator& op, unsigned long& nargs)
+    {
+        unsigned long id;
+        if (!findProcedure(name, id))
+            return false;
+
+        auto ancestor = ancestors.find(id);
+        if (ancestor == ancestors.end())
+            return false;
+
+        op = ancestor->second;
+        nargs = procedures[id].getNumArgs();
+        return true;
+    }
+
+    /*
+     * Select how `run` dispatches instructions. The switch loop is always
+     * available, threaded dispatch only when built with SCRIBBLE_THREADED.
      */
     void
-    execute (std::queue<Bytecode> instructions)
+    setDispatch (Dispatch d)
     {
-        unsigned long entry = defineProcedure(REPL_SYMBOL, 0, instructions);
+#ifndef SCRIBBLE_THREADED
+        if (d == DISPATCH_THREADED)
+            fatal("Threaded dispatch is not available in this build");
+#endif
+        dispatch = d;
+    }
 
-        PC = entry;
-        registers[REGBASE] = Data(stack.index());
+    /*
+     * Have the threaded loop check every instruction, as the switch loop
+     * always does, rather than run those verified to need no checks
+     * without them. This is only so the two loops may be compared.
+     */
+    void
+    setChecked (bool check)
+    {
+        checked = check;
+        predecode(0, _threaded.size());
+    }
 
-        while (true) {
-            Data *data = stack.reserved(PC);
-            PC++;
+    /*
+     * Compile procedures to native code with `t` once they have been called
+     * `threshold` times. Without a tier, the default, everything is
+     * interpreted.
+     */
+    void
+    setTier (NativeTier *t, unsigned long threshold = TIER_THRESHOLD)
+    {
+        tier = t;
+        tierThreshold = threshold;
+    }
 
-            if (!data->isExecutable())
-                fatal("Cannot execute non-executable data at index %d", PC);
+    /*
+     * Gather the bodies of the procedure `name` and of every procedure it may
+     * call, by symbol, to compile them into a program ahead of time. The
+     * symbol of `name` is left in `entry`. Every one of them must be defined
+     * and verified, otherwise false is returned with the first which isn't in
+     * `failed`.
+     */
+    bool
+    program (const std::string& name,
+             std::map<std::string, NativeBody>& bodies,
+             std::string& entry,
+             std::string& failed)
+    {
+        unsigned long root = procedureId(name);
+        std::vector<unsigned long> pending = { root };
+        std::set<unsigned long> seen = { root };
+
+        while (!pending.empty()) {
+            unsigned long id = pending.back();
+            pending.pop_back();
+
+            const Procedure& proc = procedures[id];
+            if (proc.getVersion() == 0 || !proc.isVerified()) {
+                failed = proc.getName();
+                return false;
+            }
 
-            Bytecode bc = data->bytecode();
-            switch (bc.op) {
-                case OP_HALT:
-                    goto cleanup;
+            NativeBody native = body(id);
+            for (auto& call : native.callees) {
+                unsigned long callee =
+                    callsites[native.code[call.first].operand].id;
+                if (seen.insert(callee).second)
+                    pending.push_back(callee);
+            }
+            bodies[proc.getSymbol()] = native;
+        }
+        entry = procedures[root].getSymbol();
+        return true;
+    }
 
-                case OP_MOVEINT:
-                    moveint(bc.primitive, bc.reg1);
-                    break;
+    /* Print what is defined, as it is defined */
+    void
+    setVerbose (bool verbose)
+    {
+        this->verbose = verbose;
+    }
 
-                case OP_MOVESTR:
-                    movestr(bc.primitive, bc.reg1);
-                    break;
+    bool
+    isVerbose ()
+    {
+        return verbose;
+    }
 
-                case OP_MOVESYM:
-                    movesym(bc.primitive, bc.reg1);
-                    break;
+    /* Whether the procedure `name` has been defined */
+    bool
+    defined (const std::string& name)
+    {
+        unsigned long id;
+        return findProcedure(Atoms::intern(name), id)
+            && procedures[id].getVersion() > 0;
+    }
 
-                case OP_LOADINT:
-                    loadint(bc.primitive, bc.reg1);
-                    break;
+    /* Whether `name` has been promoted to native code */
+    bool
+    promoted (const std::string& name)
+    {
+        return getProcedure(Atoms::intern(name)).getNative() != NULL;
+    }
 
-                case OP_LOADSTR:
-                    loadstr(bc.primitive, bc.reg1);
-                    break;
+    /*
+     * Get the entry point for a symbol.
+     */
+    unsigned long
+    procedureEntry (std::string sym)
+    {
+        return getProcedure(Atoms::intern(sym)).getEntry();
+    }
 
-                case OP_LOADSYM:
-                    loadsym(bc.primitive, bc.reg1);
-                    break;
+    /*
+     * Execute the given instructions. The given instructions are treated as
+     * coming from a REPL. Thus we add them always to the top of the executable
+     * stack and execute them as a procedure.
+     */
+    void
+    execute (const Code& code)
+    {
+        unsigned long pool = constants.size();
+        unsigned long sites = callsites.size();
+        unsigned long nfolds = folds.size();
+        unsigned long entry = defineProcedure(REPL_SYMBOL, 0, code);
+
+        run(entry);
+
+        heap.rollback(entry);
+        constants.resize(pool);
+        dropCallSites(sites);
+        dropInlineSites(entry);
+        dropFoldSites(nfolds);
+
+        /* folds are evaluated mid-compile, when nothing may move */
+        if (!fuel && !bailed && heap.garbage() >= CODE_GARBAGE
+                && heap.garbage() > heap.getLive())
+            compact();
+    }
 
-                case OP_PUSH:
-                    push(bc.reg1);
-                    break;
+    /*
+     * Slide the live procedure bodies down over the dead code redefinitions
+     * left behind and patch every address into the code to match. The
+     * constants, call sites and folds only dead code used go as well, see
+     * `renumber`. Nothing may be running, as frames would return into code
+     * which moved.
+     */
+    void
+    compact ()
+    {
+        if (stack.depth() > 0)
+            return;
+        if (verbose)
+            printf("| Compacting %lu dead instructions\n", heap.garbage());
+
+        Relocation moved = heap.compact();
+        std::vector<bool> unchecked(heap.index(), false);
+        std::map<unsigned long, unsigned long> depths;
+        for (unsigned long i = 0; i < moved.floor; i++)
+            unchecked[i] = _unchecked[i];
+        for (auto& move : moved.moves)
+            for (unsigned long i = 0; i < move.second.size; i++)
+                unchecked[move.second.to + i] = _unchecked[move.first + i];
+        for (auto& depth : this->depths)
+            if (moved.moves.count(depth.first))
+                depths[moved.moves[depth.first].to] = depth.second;
+        _unchecked = unchecked;
+        this->depths = depths;
+        predecode(0, heap.index());
+
+        unsigned long to;
+        for (auto& proc : procedures)
+            if (proc.getVersion() > 0 && moved.find(proc.getEntry(), to))
+                proc.relocate(to);
+
+        /* inline sites in dead code go, the rest keep their call sites */
+        for (auto& sites : inlineSites) {
+            std::vector<InlineSite> live;
+            for (auto& inlined : sites.second)
+                if (moved.find(inlined.address, to))
+                    live.push_back(InlineSite { to, inlined.site });
+            sites.second = live;
+        }
 
-                case OP_POP:
-                    pop(bc.reg1);
-                    break;
+        bool renumbered = renumber();
+        for (auto& site : callsites) {
+            bool live = moved.find(site.from, to);
+            assert(live);
+            (void) live;
+            site.to = to + (site.to - site.from);
+            site.from = to;
+            if (moved.find(site.entry, to))
+                site.entry = to;
+            else
+                site.version = 0;
+        }
+        indexCallSites();
 
-                case OP_PRINT:
-                    print();
-                    break;
+        for (auto& fold : folds)
+            if (moved.find(fold.target, to))
+                fold.target = to;
 
-                case OP_ADD:
-                    add();
-                    break;
+        /* native code has the old call site and fold numbers built in */
+        if (renumbered)
+            for (unsigned long id = 0; id < procedures.size(); id++)
+                if (procedures[id].getNative())
+                    swap(id);
+    }
 
-                case OP_CALL:
-                    call(bc.primitive);
-                    break; 
+    /* The number of instructions in the code heap, dead or alive */
+    unsigned long
+    codeSize ()
+    {
+        return heap.index();
+    }
 
-                case OP_RET:
-                    ret();
-                    break;
+    /* The number of call sites, dead or alive */
+    unsigned long
+    siteCount ()
+    {
+        return callsites.size();
+    }
 
-                case OP_NULL:
-                    fatal("NULL bytecode operator!");
-                default:
-                    fatal("unimplemented bytecode operator!");
-            }
+    /*
+     * Execute the instructions starting at `entry` until reaching a HALT.
+     */
+    void
+    run (unsigned long entry)
+    {
+        registers[REGBASE] = Data(stack.index());
+        if (depths.count(entry))
+            stack.reserve(depths[entry]);
+        loop(entry);
+    }
+
+    /*
+     * Called by native code through `machine_call`, which the stubs of
+     * procedures that aren't native lead to, to make the call at `index` with
+     * the stack's top at `top`. An interpreted callee is run to completion in
+     * a nested dispatch loop. Returns the new top.
+     */
+    uint64_t*
+    nativeCall (uint64_t *top, uint64_t index)
+    {
+        stack.setTop(top);
+        CallSite *site = resolve(index);
+        if (!site)
+            return stack.top();
+
+        count(site, false);
+        if (native(site)) {
+            callNative(index, site);
+        }
+        else {
+            unsigned long pc = PC;
+            enter(site, haltStub);
+            loop(PC);
+            PC = pc;
         }
+        return stack.top();
+    }
+
+    /* Push the fold at `index` for native code if it is still valid */
+    uint64_t*
+    nativeFold (uint64_t *top, uint64_t index)
+    {
+        stack.setTop(top);
+        if (folds[index].valid)
+            stack.push(folds[index].value);
+        return stack.top();
+    }
 
-    cleanup:
-        stack.reserveRollback(entry);
+    /* Print the top of the stack for native code */
+    void
+    nativePrint (uint64_t *top)
+    {
+        stack.setTop(top);
+        print();
     }
 
 protected:
@@ -181,24 +658,24 @@ protected:
 
     /* move an immediate value into a register */
     void
-    moveint (Primitive primitive, Register reg)
+    moveint (uint64_t integer, Register reg)
     {
-        assert(primitive.type() == PRM_INTEGER);
-        registers[reg].assign(primitive);
+        registers[reg] = Data((unsigned long) integer);
     }
 
+    /* move a value from the constant pool into a register */
     void
-    movestr (Primitive primitive, Register reg)
+    movestr (uint64_t constant, Register reg)
     {
-        assert(primitive.type() == PRM_STRING);
-        registers[reg].assign(primitive);
+        assert(constants[constant].type() == PRM_STRING);
+        registers[reg] = constants[constant];
     }
 
     void
-    movesym (Primitive primitive, Register reg)
+    movesym (uint64_t constant, Register reg)
     {
-        assert(primitive.type() == PRM_SYMBOL);
-        registers[reg].assign(primitive);
+        assert(constants[constant].type() == PRM_SYMBOL);
+        registers[reg] = constants[constant];
     }
 
     /* 
@@ -225,34 +702,41 @@ protected:
             assert(index >= -NUM_ARG_REGISTERS - 1);
             whence = index + 1;
         } else {
-            long base = reg(REGBASE).primitive().integer();
+            long base = reg(REGBASE).integer();
             whence = base - stack.index() + index + 1;
         }
         return stack.peek(whence);
     }
 
     void
-    loadint (Primitive primitive, Register r)
+    loadint (uint64_t index, Register r)
+    {
+        Data data = load((long) index);
+        assert(data.type() == PRM_INTEGER);
+        registers[r] = data;
+    }
+
+    void
+    loadstr (uint64_t index, Register r)
     {
-        Data data = load(primitive.integer());
-        assert(data.primitive().type() == PRM_INTEGER);
-        registers[r].assign(data);
+        Data data = load((long) index);
+        assert(data.type() == PRM_STRING);
+        registers[r] = data;
     }
 
     void
-    loadstr (Primitive primitive, Register r)
+    loadsym (uint64_t index, Register r)
     {
-        Data data = load(primitive.integer());
-        assert(data.primitive().type() == PRM_STRING);
-        registers[r].assign(data);
+        Data data = load((long) index);
+        assert(data.type() == PRM_SYMBOL);
+        registers[r] = data;
     }
 
+    /* load a value of any type, e.g. an argument */
     void
-    loadsym (Primitive primitive, Register r)
+    loadany (uint64_t index, Register r)
     {
-        Data data = load(primitive.integer());
-        assert(data.primitive().type() == PRM_SYMBOL);
-        registers[r].assign(data);
+        registers[r] = load((long) index);
     }
 
     /*
@@ -260,7 +744,7 @@ protected:
      * value on the stack into `r`.
      */
     void
-    reference (Primitive prm, Register r)
+    reference (uint64_t index, Register r)
     {
         assert(0);
     }
@@ -288,122 +772,1357 @@ protected:
     }
 
     /*
-     * Call a procedure by looking up the symbol's entry point and jumping to
-     * it.  REGBASE is just the base pointer. This pushes both the return
-     * pointer (current PC) and the current REGBASE.
+     * Call the procedure cached at the call site and jump to it. The cache is
+     * refilled first if the callee was redefined since it was filled.
+     * REGBASE is just the base pointer. The arguments stay where they were
+     * pushed and become the bottom of the callee's frame, while the return
+     * pointer (current PC) and the current REGBASE go on the control stack.
      */
     void
-    call (Primitive primitive)
+    call (uint64_t index)
     {
-        /*
-         * There should be no argument to call. The symbol of the procedure
-         * should be placed on the stack instead.
-         */
-        std::string sym = primitive.symbol();
-        auto& proc = getProcedure(sym);
-        Data old_base = reg(REGBASE);
+        call(index, PC);
+    }
+
+    /* Call as above but return straight to the RET stub */
+    void
+    callret (uint64_t index)
+    {
+        tailcall(index, retStub);
+    }
 
-        if (stack.index() - old_base.primitive().integer() < proc.nargs)
-            fatal("Not enough provided arguments for procedure `%s'", sym.c_str());
+    void
+    call (uint64_t index, unsigned long ret)
+    {
+        CallSite *site = resolve(index);
+        if (!site)
+            return;
+
+        count(site, false);
+        if (native(site)) {
+            callNative(index, site);
+            PC = ret;
+            return;
+        }
+        enter(site, ret);
+    }
 
-        /* Pop all arguments and hold them temporarily */
-        std::stack<Data> arguments;
-        for (unsigned long i = 0; i < proc.nargs; i++)
-            arguments.push(stack.pop());
+    /* Push the callee's frame and jump to it */
+    void
+    enter (CallSite *site, unsigned long ret)
+    {
+        unsigned long args = stack.index() - site->nargs;
+        stack.pushFrame(Activation { ret, base(), args });
+        stack.reserve(site->reserve);
+        registers[REGBASE] = Data(args);
+        PC = site->entry;
+    }
 
-        /*
-         * Push the return pointer and old base pointer. We do this here, after
-         * popping all arguments, so that these arguments will be automatically
-         * cleaned up when returning from the call.
-         */
-        stack.push(Data(PC));
-        stack.push(old_base);
+    /*
+     * Run the callee's native code on the arguments on top of the stack.
+     * It returns having left its value, if any, in place of them, just as
+     * an interpreted call followed by its RET would.
+     */
+    void
+    callNative (uint64_t index, CallSite *site)
+    {
+        machine_floor = stackFloor();
+        unsigned long caller = base();
+        stack.reserve(site->reserve);
+        registers[REGBASE] = Data(stack.index() - site->nargs);
+        stack.setTop(site->native(stack.top(), this, index));
+        registers[REGBASE] = Data(caller);
+    }
+
+    /*
+     * Call the procedure in place of the running one by moving the arguments
+     * down to the bottom of its frame, so the callee returns straight to our
+     * caller. Tail recursion thus runs in constant space.
+     *
+     * Whatever else is in our frame is dropped, except for its top-most value
+     * which we would have returned had the callee returned nothing. That is
+     * kept at the floor of the frame, under the callee's arguments, where
+     * `ret` finds it. Outside of any call this is a plain call to `ret`.
+     */
+    void
+    tailcall (uint64_t index)
+    {
+        tailcall(index, PC);
+    }
+
+    void
+    tailcall (uint64_t index, unsigned long ret)
+    {
+        if (stack.depth() == 0) {
+            call(index, ret);
+            return;
+        }
+
+        CallSite *site = resolve(index);
+        if (!site)
+            return;
 
         /*
-         * Set the new base pointer so that the stack index just before the
-         * base of the frame holds the old base pointer and return pointer
+         * Native code can't take over our frame, so call it in place and
+         * return what is then on top of the frame, which is what the callee
+         * would have returned to our caller.
          */
-        registers[REGBASE] = Data(stack.index());
+        count(site, true);
+        if (native(site)) {
+            callNative(index, site);
+            this->ret();
+            return;
+        }
+
+        Activation& frame = stack.topFrame();
+        unsigned long args = stack.index() - site->nargs;
+        unsigned long dest = base();
 
-        /* finally, push all arguments and jump to the procedure */
-        while (!arguments.empty()) {
-            stack.push(arguments.top());
-            arguments.pop();
+        if (args > base()) {
+            stack.set(frame.floor, stack.get(args - 1));
+            dest = frame.floor + 1;
         }
 
-        PC = proc.entry;
+        for (unsigned long i = 0; i < site->nargs; i++)
+            stack.set(dest + i, stack.get(args + i));
+        stack.truncate(dest + site->nargs);
+        stack.reserve(site->reserve);
+
+        registers[REGBASE] = Data(dest);
+        PC = site->entry;
     }
 
     /*
-     * Pops everything off the stack until hitting REGBASE. Uses the return
-     * pointer and old base pointer to setup previous stack frame. If there
-     * were values on the stack then it treats the top-most value as a return
-     * value and places it on top of the previous stack frame.
+     * Drop the frame by resetting the stack to its floor and return to the
+     * caller. If there were values in the frame then the top-most one is the
+     * return value and it is placed on top of the previous stack frame.
      */
     void
     ret ()
     {
+        Activation frame = stack.popFrame();
         Data ret;
         bool has_ret = false;
-        unsigned long floor = reg(REGBASE).primitive().integer();
 
-        if (stack.index() > floor) {
+        if (stack.index() > base()) {
             ret = stack.pop();
             has_ret = true;
         }
+        else if (base() > frame.floor) {
+            ret = stack.get(frame.floor);
+            has_ret = true;
+        }
 
-        while (stack.index() > floor)
-            stack.pop();
-
-        Data base = stack.pop();
-        Data addr = stack.pop();
-
-        PC = addr.primitive().integer();
-        registers[REGBASE] = base.primitive().integer();
+        stack.truncate(frame.floor);
+        PC = frame.ret;
+        registers[REGBASE] = Data(frame.base);
 
         if (has_ret)
             stack.push(ret);
     }
 
+    /*
+     * Push the folded value and skip the instructions computing it if it is
+     * still valid, otherwise fall through to them.
+     */
     void
-    add ()
+    fold (uint64_t index)
     {
-        Data d1 = stack.pop();
-        Data d2 = stack.pop();
-        stack.push(Data(d1.primitive().integer() + d2.primitive().integer()));
+        const FoldSite& site = folds[index];
+        if (site.valid) {
+            stack.push(site.value);
+            PC = site.target;
+        }
     }
 
-    /* print the top most value on the stack */
+    /* push an immediate value */
     void
-    print ()
+    pushint (uint64_t integer)
     {
-        Data data = stack.peek(0);
-        if (data.isExecutable())
-            fatal("Cannot print executable part of stack!");
-        data.primitive().print();
+        stack.push(Data((unsigned long) integer));
     }
 
-private:
-    Stack stack;
-    std::vector<Data> registers;
-    unsigned long PC; /* program counter */
-
-    std::map<std::string, Procedure> _definitions;
+    /* push a value from the constant pool */
+    void
+    pushconst (uint64_t constant)
+    {
+        stack.push(constants[constant]);
+    }
 
+    /* push a value from the stack, addressed as with `load` */
     void
-    setProcedure (std::string name, unsigned long entry, unsigned long nargs)
+    pushload (uint64_t index)
     {
-        _definitions[name] = Procedure(name, entry, nargs);
+        stack.push(load((long) index));
     }
 
-    const Procedure&
-    getProcedure (std::string name)
+    void
+    add ()
     {
-        auto iter = _definitions.find(name);
-        if (iter == _definitions.end())
-            fatal("Cannot find undefined symbol `%s'", name.c_str());
-        return iter->second;
+        Data d1 = stack.pop();
+        Data d2 = stack.pop();
+        stack.push(Data::add(d1, d2));
     }
-};
+
+    /*
+     * Variants of the above for instructions which the verifier proved stay
+     * within their frame, which has room reserved when it is entered, and
+     * whose loads are of the right type.
+     */
+    Data
+    uncheckedLoad (const int index)
+    {
+        if (index < 0)
+            return stack.peekUnchecked(index + 1);
+        long base = reg(REGBASE).integer();
+        return stack.peekUnchecked(base - stack.index() + index + 1);
+    }
+
+    void
+    uncheckedPush (Register r)
+    {
+        stack.pushUnchecked(reg(r));
+    }
+
+    void
+    uncheckedPop (Register r)
+    {
+        registers[r] = stack.popUnchecked();
+    }
+
+    void
+    uncheckedPushint (uint64_t integer)
+    {
+        stack.pushUnchecked(Data((unsigned long) integer));
+    }
+
+    void
+    uncheckedPushconst (uint64_t constant)
+    {
+        stack.pushUnchecked(constants[constant]);
+    }
+
+    void
+    uncheckedPushload (uint64_t index)
+    {
+        stack.pushUnchecked(uncheckedLoad((long) index));
+    }
+
+    void
+    uncheckedAdd ()
+    {
+        Data d1 = stack.popUnchecked();
+        Data d2 = stack.popUnchecked();
+        stack.pushUnchecked(Data::add(d1, d2));
+    }
+
+    /* print the top most value on the stack */
+    void
+    print ()
+    {
+        if (fuel) {
+            bail();
+            return;
+        }
+        stack.peek(0).print();
+    }
+
+private:
+    Stack stack;
+    CodeHeap heap;
+    Data registers[REGCOUNT];
+    unsigned long PC; /* program counter */
+    unsigned long retStub;
+    unsigned long haltStub;
+    Dispatch dispatch;
+    bool checked;
+    bool verbose;
+    NativeTier *tier;
+    unsigned long tierThreshold;
+
+    /*
+     * Only while evaluating a fold is there fuel, the number of calls which
+     * may still be made. Every procedure called is recorded, and anything
+     * impure bails out.
+     */
+    unsigned long fuel;
+    bool bailed;
+    std::set<unsigned long> touched;
+
+    /* constant pools of all defined procedures, indexed by operands */
+    std::vector<Data> constants;
+
+    /* predecoded handlers, parallel to the code heap */
+    std::vector<Threaded> _threaded;
+    const void* const* _handlers;
+
+    /*
+     * Which instructions were verified to need no checks, parallel to the
+     * code heap, and the handlers the threaded loop runs
+     * them with. Verified entry points map to the depth of their frame.
+     */
+    std::vector<bool> _unchecked;
+    const void* const* _uncheckedHandlers;
+    std::map<unsigned long, unsigned long> depths;
+
+    /*
+     * Procedures indexed by id and the id of every name ever referenced,
+     * indexed by the name's atom. Names never referenced have NO_PROCEDURE.
+     */
+    std::vector<Procedure> procedures;
+    std::vector<unsigned long> procedureIds;
+
+    /*
+     * Call sites, and the indices of those calling each procedure by id and
+     * of those in the code at each entry.
+     */
+    std::vector<CallSite> callsites;
+    std::map<unsigned long, std::vector<unsigned long>> calleeSites;
+    std::map<unsigned long, std::vector<unsigned long>> bodySites;
+
+    /* operators of the ancestors and where each was inlined, by id */
+    std::map<unsigned long, Operator> ancestors;
+    std::map<unsigned long, std::vector<InlineSite>> inlineSites;
+
+    /* folded values and the folds depending on each procedure, by id */
+    std::vector<FoldSite> folds;
+    std::map<unsigned long, std::vector<unsigned long>> foldDeps;
+
+    /* Give up on evaluating a fold */
+    void
+    bail ()
+    {
+        bailed = true;
+        PC = haltStub;
+    }
+
+    /*
+     * Turn a constant into a value. Strings and symbols point at their name
+     * in the atom table, which every Machine shares.
+     */
+    Data
+    intern (const Primitive& primitive)
+    {
+        switch (primitive.type()) {
+            case PRM_INTEGER:
+                return Data(primitive.integer());
+            case PRM_STRING:
+                return Data::string(&Atoms::name(primitive.atom()));
+            case PRM_SYMBOL:
+                return Data::symbol(&Atoms::name(primitive.atom()));
+            default:
+                return Data();
+        }
+    }
+
+    /* Find the id of the procedure `name`, if it was ever referenced */
+    bool
+    findProcedure (Atom name, unsigned long& id)
+    {
+        if (name >= procedureIds.size() || procedureIds[name] == NO_PROCEDURE)
+            return false;
+        id = procedureIds[name];
+        return true;
+    }
+
+    /*
+     * Get the id for the procedure `name`, reserving one for names which
+     * have not been defined yet so that callers may be resolved before their
+     * callees exist.
+     */
+    unsigned long
+    procedureId (Atom name)
+    {
+        unsigned long id;
+        if (findProcedure(name, id))
+            return id;
+
+        /* Machines may share a tier, so every symbol is numbered uniquely */
+        static unsigned long symbols = 0;
+
+        const std::string& str = Atoms::name(name);
+        id = procedures.size();
+        procedures.push_back(Procedure(str, 0UL, 0UL));
+        procedures[id].setSymbol(str + "." + std::to_string(symbols++));
+        if (procedureIds.size() <= name)
+            procedureIds.resize(Atoms::size(), NO_PROCEDURE);
+        procedureIds[name] = id;
+        return id;
+    }
+
+    unsigned long
+    procedureId (const std::string& name)
+    {
+        return procedureId(Atoms::intern(name));
+    }
+
+    const Procedure&
+    getProcedure (Atom name)
+    {
+        const Procedure& proc = procedures[procedureId(name)];
+        if (proc.getVersion() == 0)
+            fatal("Cannot find undefined symbol `%s'",
+                    Atoms::name(name).c_str());
+        return proc;
+    }
+
+    /*
+     * Create an unfilled call site for calls to `name`. No procedure has the
+     * version it starts with, so the first call always fills it.
+     */
+    unsigned long
+    callSite (Atom name)
+    {
+        CallSite site = { procedureId(name), (unsigned long) -1, 0, 0, 0,
+            Arity { false, 0, -1 }, false, 0, 0, NULL };
+        calleeSites[site.id].push_back(callsites.size());
+        callsites.push_back(site);
+        return callsites.size() - 1;
+    }
+
+    /* Define a procedure which simply runs `op` and may be inlined as `op` */
+    void
+    defineAncestor (std::string name,
+                    unsigned long nargs,
+                    Operator op,
+                    bool pure)
+    {
+        defineProcedure(name, nargs, Code({
+            Bytecode(op),
+            Bytecode(OP_RET)
+        }), pure);
+        ancestors[procedureId(name)] = op;
+    }
+
+    /* Create the site for a fold in the procedure being defined at `entry` */
+    unsigned long
+    foldSite (const Fold& fold, unsigned long entry)
+    {
+        FoldSite site = { intern(fold.value), entry + fold.end, true };
+        for (unsigned long id : fold.deps)
+            foldDeps[id].push_back(folds.size());
+        folds.push_back(site);
+        return folds.size() - 1;
+    }
+
+    /* Invalidate every fold which depends on the procedure `id` */
+    void
+    unfold (unsigned long id)
+    {
+        for (unsigned long fold : foldDeps[id])
+            folds[fold].valid = false;
+        foldDeps.erase(id);
+    }
+
+    /* Forget the call sites from `index` on, the newest first */
+    void
+    dropCallSites (unsigned long index)
+    {
+        while (callsites.size() > index) {
+            const CallSite& site = callsites.back();
+            calleeSites[site.id].pop_back();
+            auto& body = bodySites[site.from];
+            if (!body.empty() && body.back() == callsites.size() - 1)
+                body.pop_back();
+            if (body.empty())
+                bodySites.erase(site.from);
+            callsites.pop_back();
+        }
+    }
+
+    /* Index the call sites by callee and by the code they are in afresh */
+    void
+    indexCallSites ()
+    {
+        calleeSites.clear();
+        bodySites.clear();
+        for (unsigned long i = 0; i < callsites.size(); i++) {
+            calleeSites[callsites[i].id].push_back(i);
+            bodySites[callsites[i].from].push_back(i);
+        }
+    }
+
+    /*
+     * Keep only the constants, call sites and folds which the code left in
+     * the heap, or an inline site in it, still refers to, in the order they
+     * were made, and patch the operands referring to them to match. Returns
+     * whether any call site or fold was renumbered.
+     */
+    bool
+    renumber ()
+    {
+        const unsigned long none = (unsigned long) -1;
+        std::vector<unsigned long> constant(constants.size(), none);
+        std::vector<unsigned long> site(callsites.size(), none);
+        std::vector<unsigned long> fold(folds.size(), none);
+
+        for (unsigned long i = 0; i < heap.index(); i++) {
+            const Bytecode& bc = *heap.at(i);
+            switch (bc.op) {
+                case OP_CALL:
+                case OP_TAILCALL:
+                case OP_CALLRET:
+                    site[bc.operand] = 0;
+                    break;
+                case OP_FOLD:
+                    fold[bc.operand] = 0;
+                    break;
+                case OP_MOVESTR:
+                case OP_MOVESYM:
+                case OP_PUSHCONST:
+                    constant[bc.operand] = 0;
+                    break;
+                default:
+                    break;
+            }
+        }
+        for (auto& sites : inlineSites)
+            for (auto& inlined : sites.second)
+                site[inlined.site] = 0;
+
+        bool moved = keep(callsites, site) | keep(folds, fold);
+        keep(constants, constant);
+
+        for (unsigned long i = 0; i < heap.index(); i++) {
+            Bytecode& bc = *heap.at(i);
+            switch (bc.op) {
+                case OP_CALL:
+                case OP_TAILCALL:
+                case OP_CALLRET:
+                    bc.operand = site[bc.operand];
+                    break;
+                case OP_FOLD:
+                    bc.operand = fold[bc.operand];
+                    break;
+                case OP_MOVESTR:
+                case OP_MOVESYM:
+                case OP_PUSHCONST:
+                    bc.operand = constant[bc.operand];
+                    break;
+                default:
+                    break;
+            }
+        }
+        for (auto& sites : inlineSites)
+            for (auto& inlined : sites.second)
+                inlined.site = site[inlined.site];
+
+        for (auto iter = foldDeps.begin(); iter != foldDeps.end(); ) {
+            std::vector<unsigned long> live;
+            for (unsigned long index : iter->second)
+                if (fold[index] != none)
+                    live.push_back(fold[index]);
+            iter->second = live;
+            if (live.empty())
+                iter = foldDeps.erase(iter);
+            else
+                iter++;
+        }
+
+        return moved;
+    }
+
+    /*
+     * Keep the entries of `table` which `index` marks, numbering them in
+     * `index` as they are kept. Returns whether any kept entry moved.
+     */
+    template <typename T>
+    static bool
+    keep (std::vector<T>& table, std::vector<unsigned long>& index)
+    {
+        bool moved = false;
+        unsigned long next = 0;
+        for (unsigned long i = 0; i < table.size(); i++) {
+            if (index[i] == (unsigned long) -1)
+                continue;
+            index[i] = next;
+            if (next != i) {
+                table[next] = table[i];
+                moved = true;
+            }
+            next++;
+        }
+        table.resize(next);
+        return moved;
+    }
+
+    /* Forget the folds from `index` on */
+    void
+    dropFoldSites (unsigned long index)
+    {
+        folds.resize(index);
+        for (auto& deps : foldDeps) {
+            auto& v = deps.second;
+            while (!v.empty() && v.back() >= index)
+                v.pop_back();
+        }
+    }
+
+    /*
+     * The ancestor `id` is being redefined. Patch every place it was inlined
+     * back into a call and stop inlining it. An inlined operator fused with
+     * a following RET becomes a CALLRET.
+     */
+    void
+    uninline (unsigned long id)
+    {
+        for (auto& inlined : inlineSites[id]) {
+            Bytecode *bc = heap.at(inlined.address);
+            Operator op = OP_CALL;
+            if (bc->op == OP_ADDRET)
+                op = OP_CALLRET;
+            else if (bc[1].op == OP_RET)
+                op = OP_TAILCALL;
+            *bc = Bytecode(op, inlined.site);
+            predecode(inlined.address, inlined.address + 1);
+            demote(callsites[inlined.site].from);
+        }
+        inlineSites.erase(id);
+        ancestors.erase(id);
+    }
+
+    /* Forget inline sites in code at or after `address` */
+    void
+    dropInlineSites (unsigned long address)
+    {
+        for (auto& sites : inlineSites) {
+            auto& v = sites.second;
+            while (!v.empty() && v.back().address >= address)
+                v.pop_back();
+        }
+    }
+
+    unsigned long
+    base ()
+    {
+        return reg(REGBASE).integer();
+    }
+
+    /*
+     * The call site at `index`, ready to be called. Returns NULL if the fold
+     * being evaluated has given up instead.
+     */
+    CallSite*
+    resolve (uint64_t index)
+    {
+        CallSite &site = callsites[index];
+        if (site.version != procedures[site.id].getVersion())
+            refill(site);
+
+        if (fuel) {
+            touched.insert(site.id);
+            if (--fuel == 0) {
+                bail();
+                return NULL;
+            }
+        }
+
+        if (!site.safe && stack.index() - base() < site.nargs)
+            fatal("Not enough provided arguments for procedure `%s'",
+                    procedures[site.id].getName().c_str());
+        return &site;
+    }
+
+    /*
+     * Count a call through `site` and promote the callee to native code once
+     * it gets hot, refilling the site so that this very call runs natively.
+     */
+    void
+    count (CallSite *site, bool backedge)
+    {
+        if (fuel)
+            return;
+        if (!procedures[site->id].enter(backedge, tierThreshold) || !tier)
+            return;
+        promote(site->id);
+        if (site->version != procedures[site->id].getVersion())
+            refill(*site);
+    }
+
+    /*
+     * The native code to call through `site` instead of interpreting. Folds
+     * are always interpreted, as native code has no fuel.
+     */
+    NativeProcedure
+    native (CallSite *site)
+    {
+        return tier && !fuel ? site->native : NULL;
+    }
+
+    /* The floor of the calling thread's C stack, see NATIVE_SLACK */
+    static char*
+    stackFloor ()
+    {
+        static thread_local char *floor = NULL;
+        if (floor)
+            return floor;
+
+        pthread_attr_t attr;
+        void *start;
+        size_t size;
+        if (pthread_getattr_np(pthread_self(), &attr) != 0)
+            fatal("Call: cannot find the C stack");
+        pthread_attr_getstack(&attr, &start, &size);
+        pthread_attr_destroy(&attr);
+        floor = (char*) start + NATIVE_SLACK;
+        return floor;
+    }
+
+    /* What a tier needs to compile the procedure `id`, which is verified */
+    NativeBody
+    body (unsigned long id)
+    {
+        const Procedure& proc = procedures[id];
+        unsigned long entry = proc.getEntry();
+        NativeBody body = { heap.at(entry), proc.getSize(),
+            proc.getNumArgs(), proc.getDepth(), &constants, stack.limit(),
+            {}, {}, {} };
+
+        for (unsigned long i = 0; i < body.size; i++) {
+            const Bytecode& bc = body.code[i];
+            if (bc.op == OP_FOLD)
+                body.folds[i] = folds[bc.operand].target - entry;
+            else if (bc.op == OP_CALL || bc.op == OP_TAILCALL
+                    || bc.op == OP_CALLRET) {
+                const CallSite& site = callsites[bc.operand];
+                body.callees[i] = procedures[site.id].getSymbol();
+                if (bc.op != OP_CALL && site.assumed.known
+                        && site.assumed.returns == 1)
+                    body.tails[i] = site.assumed.nargs;
+            }
+        }
+        return body;
+    }
+
+    /*
+     * Have the tier compile the body of the procedure `id`. Only verified
+     * procedures are promoted, as native code relies on the depth of their
+     * frame and their loads being within it. Bodies the tier can't compile
+     * stay interpreted.
+     */
+    void
+    promote (unsigned long id)
+    {
+        Procedure& proc = procedures[id];
+        if (!proc.isVerified())
+            return;
+
+        NativeProcedure native = tier->compile(proc.getSymbol(), body(id));
+        if (!native)
+            return;
+
+        if (verbose)
+            printf("| Promoting `%s' to native code\n", proc.getName().c_str());
+        proc.promote(native);
+
+        /* its native callers may now inline it, as may it its callees */
+        std::vector<std::string> callers = proc.getCallers();
+        cluster(id);
+        for (const std::string& caller : callers)
+            cluster(procedureId(caller));
+    }
+
+    /*
+     * Hand the tier the native procedure `id` along with the native
+     * procedures it calls, directly or not, up to CLUSTER_SIZE of them, so
+     * that it may compile them together and inline calls between them.
+     */
+    void
+    cluster (unsigned long id)
+    {
+        if (!procedures[id].getNative())
+            return;
+
+        std::map<std::string, NativeBody> bodies;
+        std::vector<unsigned long> queue = { id };
+        for (unsigned long i = 0; i < queue.size()
+                && bodies.size() < CLUSTER_SIZE; i++) {
+            const Procedure& proc = procedures[queue[i]];
+            if (bodies.count(proc.getSymbol()))
+                continue;
+            bodies[proc.getSymbol()] = body(queue[i]);
+            for (const std::string& callee : proc.getCallees()) {
+                unsigned long calleeId = procedureId(callee);
+                if (procedures[calleeId].getNative()
+                        && procedures[calleeId].isVerified())
+                    queue.push_back(calleeId);
+            }
+        }
+
+        if (bodies.size() > 1)
+            tier->cluster(procedures[id].getSymbol(), bodies);
+    }
+
+    /*
+     * Note which procedures the procedure `id` calls in its new `code`, in
+     * place of those it called before.
+     */
+    void
+    link (unsigned long id, const Code& code)
+    {
+        std::string name = procedures[id].getName();
+        for (const std::string& callee : procedures[id].getCallees())
+            procedures[procedureId(callee)].removeCaller(name);
+        procedures[id].clearCallees();
+
+        std::set<std::string> callees;
+        for (const Bytecode& bc : code.instructions())
+            if (bc.op == OP_CALL || bc.op == OP_TAILCALL)
+                callees.insert(code.constants()[bc.operand].symbol());
+        for (const std::string& callee : callees) {
+            /* looking the callee up may move the procedures */
+            unsigned long calleeId = procedureId(callee);
+            procedures[calleeId].addCaller(name);
+            procedures[id].addCallee(callee);
+        }
+    }
+
+    /*
+     * The procedure `id`, which was native, has just been redefined. Rather
+     * than wait for the new body to get hot, compile it straight away and
+     * point its stub at it, so that native callers call it without being
+     * compiled again. If it can't be compiled the stub leads back to the
+     * interpreter.
+     */
+    void
+    swap (unsigned long id)
+    {
+        Procedure& proc = procedures[id];
+        if (tier)
+            promote(id);
+        if (!proc.getNative())
+            demote(proc);
+    }
+
+    /* Drop the procedure's native code and interpret it again */
+    void
+    demote (Procedure& proc)
+    {
+        proc.demote();
+        if (tier)
+            tier->interpret(proc.getSymbol());
+    }
+
+    /* The body at `entry` changed underneath its native code, so drop it */
+    void
+    demote (unsigned long entry)
+    {
+        for (auto& proc : procedures)
+            if (proc.getEntry() == entry && proc.getNative())
+                demote(proc);
+    }
+
+    void
+    refill (CallSite& site)
+    {
+        const Procedure& proc = procedures[site.id];
+        if (proc.getVersion() == 0)
+            fatal("Cannot find undefined symbol `%s'", proc.getName().c_str());
+
+        site.version = proc.getVersion();
+        site.entry = proc.getEntry();
+        site.nargs = proc.getNumArgs();
+        site.reserve = 0;
+        if (proc.isVerified() && proc.getDepth() > site.nargs)
+            site.reserve = proc.getDepth() - site.nargs;
+        site.native = proc.getNative();
+
+        if (site.safe && !matches(site.assumed, proc))
+            unverify(site.from, site.to);
+    }
+
+    /* The arity assumed of calls to `name` by code being defined */
+    Arity
+    arity (Atom name, const Code& code, unsigned long index)
+    {
+        unsigned long id;
+        if (findProcedure(name, id)) {
+            const Procedure& proc = procedures[id];
+            if (proc.getVersion() > 0)
+                return Arity { true, proc.getNumArgs(),
+                    proc.isVerified() ? proc.getReturns() : -1 };
+        }
+
+        /* a procedure yet to be defined takes the arguments it was given */
+        for (auto& call : code.calls())
+            if (call.first == index)
+                return Arity { true, call.second, 1 };
+        return Arity { false, 0, -1 };
+    }
+
+    /* The arity of every call in `code`, or of the call each inline replaced */
+    std::vector<Arity>
+    arities (const Code& code)
+    {
+        std::vector<Arity> arities(code.size(), Arity { false, 0, -1 });
+
+        for (unsigned long i = 0; i < code.size(); i++) {
+            const Bytecode& bc = code.instructions()[i];
+            if (bc.op == OP_CALL || bc.op == OP_TAILCALL)
+                arities[i] = arity(code.constants()[bc.operand].atom(),
+                        code, i);
+        }
+        for (auto& inlined : code.inlined())
+            arities[inlined.first] = arity(
+                    code.constants()[inlined.second].atom(), code,
+                    inlined.first);
+        return arities;
+    }
+
+    static bool
+    matches (const Arity& arity, const Procedure& proc)
+    {
+        if (proc.getNumArgs() != arity.nargs)
+            return false;
+        return arity.returns < 0
+            || (proc.isVerified() && proc.getReturns() == arity.returns);
+    }
+
+    /* Note what the code in [from, to) assumed when calling through `index` */
+    void
+    assume (unsigned long index,
+            Arity arity,
+            bool verified,
+            unsigned long from,
+            unsigned long to)
+    {
+        CallSite& site = callsites[index];
+        site.assumed = arity;
+        site.safe = verified;
+        site.from = from;
+        site.to = to;
+        bodySites[from].push_back(index);
+    }
+
+    /*
+     * The code in [from, to) was verified against a callee which no longer
+     * matches, so run it with every check from now on. If it is the body of
+     * a procedure then what it returns is no longer known either, and
+     * anything verified against that is checked as well.
+     */
+    void
+    unverify (unsigned long from, unsigned long to)
+    {
+        for (unsigned long i = from; i < to; i++)
+            _unchecked[i] = false;
+        predecode(from, to);
+
+        auto body = bodySites.find(from);
+        if (body != bodySites.end())
+            for (unsigned long index : body->second)
+                callsites[index].safe = false;
+
+        for (unsigned long id = 0; id < procedures.size(); id++) {
+            Procedure& proc = procedures[id];
+            if (proc.getEntry() != from || !proc.isVerified())
+                continue;
+            proc.unverify();
+            if (proc.getNative())
+                demote(proc);
+            for (unsigned long index : calleeSites[id]) {
+                const CallSite& site = callsites[index];
+                if (site.safe && site.assumed.returns >= 0)
+                    unverify(site.from, site.to);
+            }
+        }
+    }
+
+    /* Make room for the instructions up to `to` in the parallel tables */
+    void
+    grow (unsigned long to)
+    {
+        if (_unchecked.size() < to)
+            _unchecked.resize(to, false);
+        if (_threaded.size() < to)
+            _threaded.resize(to);
+    }
+
+    /*
+     * Translate the instructions in [from, to) of the code heap into handler
+     * addresses for the threaded loop.
+     */
+    void
+    predecode (unsigned long from, unsigned long to)
+    {
+        grow(to);
+#ifdef SCRIBBLE_THREADED
+        for (unsigned long i = from; i < to; i++) {
+            const Bytecode *bc = heap.at(i);
+            const void* const* handlers =
+                _unchecked[i] && !checked ? _uncheckedHandlers : _handlers;
+            _threaded[i].handler = handlers[bc->op < NUM_OP ? bc->op : NUM_OP];
+            _threaded[i].bc = bc;
+        }
+#endif
+    }
+
+    /* Run from `entry` until reaching a HALT with the selected dispatch */
+    void
+    loop (unsigned long entry)
+    {
+#ifdef SCRIBBLE_THREADED
+        if (dispatch == DISPATCH_THREADED) {
+            runThreaded(entry, false);
+            return;
+        }
+#endif
+        runSwitch(entry);
+    }
+
+    /*
+     * The original dispatch loop. Each step switches on the operator of the
+     * instruction at PC.
+     */
+    void
+    runSwitch (unsigned long entry)
+    {
+        PC = entry;
+
+        while (true) {
+            const Bytecode &bc = *heap.at(PC);
+            PC++;
+
+            switch (bc.op) {
+                case OP_HALT:
+                    return;
+
+                case OP_MOVEINT:
+                    moveint(bc.operand, bc.reg1);
+                    break;
+
+                case OP_MOVESTR:
+                    movestr(bc.operand, bc.reg1);
+                    break;
+
+                case OP_MOVESYM:
+                    movesym(bc.operand, bc.reg1);
+                    break;
+
+                case OP_LOADINT:
+                    loadint(bc.operand, bc.reg1);
+                    break;
+
+                case OP_LOADSTR:
+                    loadstr(bc.operand, bc.reg1);
+                    break;
+
+                case OP_LOADSYM:
+                    loadsym(bc.operand, bc.reg1);
+                    break;
+
+                case OP_LOAD:
+                    loadany(bc.operand, bc.reg1);
+                    break;
+
+                case OP_PUSH:
+                    push(bc.reg1);
+                    break;
+
+                case OP_POP:
+                    pop(bc.reg1);
+                    break;
+
+                case OP_PRINT:
+                    print();
+                    break;
+
+                case OP_ADD:
+                    add();
+                    break;
+
+                case OP_CALL:
+                    call(bc.operand);
+                    break; 
+
+                case OP_RET:
+                    ret();
+                    break;
+
+                case OP_PUSHINT:
+                    pushint(bc.operand);
+                    break;
+
+                case OP_PUSHCONST:
+                    pushconst(bc.operand);
+                    break;
+
+                case OP_PUSHLOAD:
+                    pushload(bc.operand);
+                    break;
+
+                case OP_ADDRET:
+                    add();
+                    ret();
+                    break;
+
+                case OP_CALLRET:
+                    callret(bc.operand);
+                    break;
+
+                case OP_FOLD:
+                    fold(bc.operand);
+                    break;
+
+                case OP_TAILCALL:
+                    tailcall(bc.operand);
+                    break;
+
+                case OP_NULL:
+                    fatal("NULL bytecode operator!");
+                default:
+                    fatal("unimplemented bytecode operator!");
+            }
+        }
+    }
+
+#ifdef SCRIBBLE_THREADED
+    /*
+     * Direct-threaded dispatch loop. Each handler jumps straight to the
+     * handler of the next predecoded instruction instead of returning to a
+     * central switch. When `init` is set this only publishes the handler
+     * addresses, which are local to this function, for `predecode`.
+     */
+    void
+    runThreaded (unsigned long entry, bool init)
+    {
+        /* indexed by Operator, with a trailing slot for invalid operators */
+        static const void* const labels[NUM_OP + 1] = {
+            &&op_null,
+            &&op_halt,
+            &&op_movestr,
+            &&op_moveint,
+            &&op_movesym,
+            &&op_loadstr,
+            &&op_loadint,
+            &&op_loadsym,
+            &&op_load,
+            &&op_push,
+            &&op_pop,
+            &&op_call,
+            &&op_ret,
+            &&op_add,
+            &&op_print,
+            &&op_pushint,
+            &&op_pushconst,
+            &&op_pushload,
+            &&op_addret,
+            &&op_callret,
+            &&op_fold,
+            &&op_tailcall,
+            &&op_unimplemented
+        };
+
+        /* the same, but for instructions which were verified */
+        static const void* const unchecked[NUM_OP + 1] = {
+            &&op_null,
+            &&op_halt,
+            &&op_movestr,
+            &&op_moveint,
+            &&op_movesym,
+            &&op_unchecked_load,
+            &&op_unchecked_load,
+            &&op_unchecked_load,
+            &&op_unchecked_load,
+            &&op_unchecked_push,
+            &&op_unchecked_pop,
+            &&op_call,
+            &&op_ret,
+            &&op_unchecked_add,
+            &&op_print,
+            &&op_unchecked_pushint,
+            &&op_unchecked_pushconst,
+            &&op_unchecked_pushload,
+            &&op_unchecked_addret,
+            &&op_callret,
+            &&op_fold,
+            &&op_tailcall,
+            &&op_unimplemented
+        };
+
+        if (init) {
+            _handlers = labels;
+            _uncheckedHandlers = unchecked;
+            return;
+        }
+
+        const Threaded *code = _threaded.data();
+        const Threaded *t;
+
+#define DISPATCH() do { t = &code[PC++]; goto *t->handler; } while (0)
+
+        PC = entry;
+        DISPATCH();
+
+    op_halt:
+        return;
+
+    op_movestr:
+        movestr(t->bc->operand, t->bc->reg1);
+        DISPATCH();
+
+    op_moveint:
+        moveint(t->bc->operand, t->bc->reg1);
+        DISPATCH();
+
+    op_movesym:
+        movesym(t->bc->operand, t->bc->reg1);
+        DISPATCH();
+
+    op_loadstr:
+        loadstr(t->bc->operand, t->bc->reg1);
+        DISPATCH();
+
+    op_loadint:
+        loadint(t->bc->operand, t->bc->reg1);
+        DISPATCH();
+
+    op_loadsym:
+        loadsym(t->bc->operand, t->bc->reg1);
+        DISPATCH();
+
+    op_load:
+        loadany(t->bc->operand, t->bc->reg1);
+        DISPATCH();
+
+    op_push:
+        push(t->bc->reg1);
+        DISPATCH();
+
+    op_pop:
+        pop(t->bc->reg1);
+        DISPATCH();
+
+    op_call:
+        call(t->bc->operand);
+        DISPATCH();
+
+    op_ret:
+        ret();
+        DISPATCH();
+
+    op_add:
+        add();
+        DISPATCH();
+
+    op_print:
+        print();
+        DISPATCH();
+
+    op_pushint:
+        pushint(t->bc->operand);
+        DISPATCH();
+
+    op_pushconst:
+        pushconst(t->bc->operand);
+        DISPATCH();
+
+    op_pushload:
+        pushload(t->bc->operand);
+        DISPATCH();
+
+    op_addret:
+        add();
+        ret();
+        DISPATCH();
+
+    op_callret:
+        callret(t->bc->operand);
+        DISPATCH();
+
+    op_fold:
+        fold(t->bc->operand);
+        DISPATCH();
+
+    op_tailcall:
+        tailcall(t->bc->operand);
+        DISPATCH();
+
+    op_unchecked_load:
+        registers[t->bc->reg1] = uncheckedLoad((long) t->bc->operand);
+        DISPATCH();
+
+    op_unchecked_push:
+        uncheckedPush(t->bc->reg1);
+        DISPATCH();
+
+    op_unchecked_pop:
+        uncheckedPop(t->bc->reg1);
+        DISPATCH();
+
+    op_unchecked_add:
+        uncheckedAdd();
+        DISPATCH();
+
+    op_unchecked_pushint:
+        uncheckedPushint(t->bc->operand);
+        DISPATCH();
+
+    op_unchecked_pushconst:
+        uncheckedPushconst(t->bc->operand);
+        DISPATCH();
+
+    op_unchecked_pushload:
+        uncheckedPushload(t->bc->operand);
+        DISPATCH();
+
+    op_unchecked_addret:
+        uncheckedAdd();
+        ret();
+        DISPATCH();
+
+    op_null:
+        fatal("NULL bytecode operator!");
+
+    op_unimplemented:
+        fatal("unimplemented bytecode operator!");
+
+#undef DISPATCH
+    }
+#endif
+};
+
+/* The hooks native code calls back into the Machine with */
+extern "C" {
+    char *machine_floor = NULL;
+
+    uint64_t*
+    machine_call (uint64_t *top, void *machine, uint64_t site)
+    {
+        return ((Machine*) machine)->nativeCall(top, site);
+    }
+
+    void
+    machine_overflow ()
+    {
+        fatal("Push: stack overflow");
+    }
+
+    void
+    machine_frame_overflow ()
+    {
+        fatal("Call: frame stack overflow");
+    }
+
+    uint64_t
+    machine_add (uint64_t a, uint64_t b)
+    {
+        Data x, y;
+        x.word = a;
+        y.word = b;
+        return Data::add(x, y).word;
+    }
+
+    uint64_t*
+    machine_fold (void *machine, uint64_t *top, uint64_t fold)
+    {
+        return ((Machine*) machine)->nativeFold(top, fold);
+    }
+
+    void
+    machine_print (void *machine, uint64_t *top)
+    {
+        ((Machine*) machine)->nativePrint(top);
+    }
+}
 
 #endif
@@ -1,15 +1,61 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <sstream>
 
 #include "parse.hpp"
+#include "compile.hpp"
 #include "ir.hpp"
 #include "irbuilder.hpp"
 #include "procedure.hpp"
 #include "runtime.hpp"
 
+/* The procedure a built executable runs */
+#define BUILD_ENTRY "main"
+
+/*
+ * Evaluate every expression in `source` and build the procedure `main`, with
+ * everything it calls, into an executable at `output`. Expressions other
+ * than definitions are evaluated as the program is built, as in the REPL.
+ */
+static int
+build (const char *source, const char *output)
+{
+    std::ifstream input(source);
+    if (!input)
+        fatal("Cannot open `%s'", source);
+
+    Machine machine(false);
+    while (!(input >> std::ws).eof()) {
+        Parse parse(input);
+        Compile compile(machine);
+        compile.setPeephole(true);
+        machine.execute(compile.tokens(parse.stream()));
+    }
+
+    std::map<std::string, NativeBody> bodies;
+    std::string entry, failed;
+    if (!machine.program(BUILD_ENTRY, bodies, entry, failed)) {
+        if (!machine.defined(failed))
+            fatal("Cannot build `%s' as it isn't defined", failed.c_str());
+        fatal("Cannot build `%s' as it isn't verified", failed.c_str());
+    }
+
+    Runtime runtime;
+    return runtime.build(bodies, entry, output) ? 0 : 1;
+}
+
 int
 main (int argc, char **argv)
 {
+    if (argc >= 3 && strcmp(argv[1], "build") == 0) {
+        const char *output = "a.out";
+        if (argc == 5 && strcmp(argv[3], "-o") == 0)
+            output = argv[4];
+        else if (argc != 3)
+            fatal("Usage: %s build <source> [-o <output>]", argv[0]);
+        return build(argv[2], output);
+    }
     return 0;
 }
@@ -0,0 +1,178 @@
+#ifndef SCRIBBLE_PEEPHOLE
+#define SCRIBBLE_PEEPHOLE
+
+#include <vector>
+#include <set>
+#include "code.hpp"
+
+/*
+ * A pass over a procedure's Code run after compiling it and before it is
+ * defined. Common sequences are fused into superinstructions:
+ *
+ *      MOVEINT r, n     ; PUSH r   =>  PUSHINT n
+ *      MOVESTR/SYM r, c ; PUSH r   =>  PUSHCONST c
+ *      LOAD* r, i       ; PUSH r   =>  PUSHLOAD i
+ *      ADD              ; RET      =>  ADDRET
+ *
+ * and moves or loads into registers which are never read are dropped.
+ *
+ * The scratch registers REG1-REG3 are not preserved across calls and returns
+ * (nor passed through them), so they are dead at CALL, RET and HALT.
+ *
+ * A FOLD may jump to the end of the instructions it stands in for, so no pair
+ * is fused across the end of a fold.
+ */
+class Peephole
+{
+public:
+    Peephole ()
+        : _enabled(true)
+    {}
+
+    void
+    setEnabled (bool enabled)
+    {
+        _enabled = enabled;
+    }
+
+    bool
+    enabled ()
+    {
+        return _enabled;
+    }
+
+    /* Rewrite `code` in place, returning the number of instructions saved */
+    unsigned long
+    optimize (Code& code)
+    {
+        if (!_enabled)
+            return 0;
+
+        const std::vector<Bytecode>& in = code.instructions();
+        std::vector<Bytecode> out;
+        std::vector<unsigned long> moved(in.size() + 1);
+        std::set<unsigned long> targets;
+
+        for (const Fold& fold : code.folds())
+            targets.insert(fold.end);
+
+        for (unsigned long i = 0; i < in.size(); i++) {
+            const Bytecode& bc = in[i];
+            bool paired = i + 1 < in.size() && !targets.count(i + 1);
+            moved[i] = out.size();
+
+            if (writes(bc)) {
+                Register r = bc.reg1;
+
+                if (dead(in, i + 1, r))
+                    continue;
+
+                if (paired && in[i + 1].op == OP_PUSH
+                        && in[i + 1].reg1 == r && dead(in, i + 2, r)
+                        && fuse(bc, out)) {
+                    moved[++i] = out.size() - 1;
+                    continue;
+                }
+            }
+
+            if (bc.op == OP_ADD && paired && in[i + 1].op == OP_RET) {
+                out.push_back(Bytecode(OP_ADDRET));
+                moved[++i] = out.size() - 1;
+                continue;
+            }
+
+            out.push_back(bc);
+        }
+
+        moved[in.size()] = out.size();
+        unsigned long saved = in.size() - out.size();
+        code.replace(out, moved);
+        return saved;
+    }
+
+protected:
+    bool _enabled;
+
+    /* Whether the instruction only writes its first register */
+    static bool
+    writes (const Bytecode& bc)
+    {
+        switch (bc.op) {
+            case OP_MOVEINT:
+            case OP_MOVESTR:
+            case OP_MOVESYM:
+            case OP_LOADINT:
+            case OP_LOADSTR:
+            case OP_LOADSYM:
+            case OP_LOAD:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    /*
+     * Whether the value of `r` before instruction `i` is never read, i.e. it
+     * is overwritten or control leaves the procedure first.
+     */
+    static bool
+    dead (const std::vector<Bytecode>& code, unsigned long i, Register r)
+    {
+        for (; i < code.size(); i++) {
+            const Bytecode& bc = code[i];
+            switch (bc.op) {
+                case OP_PUSH:
+                    if (bc.reg1 == r)
+                        return false;
+                    break;
+
+                case OP_POP:
+                    if (bc.reg1 == r)
+                        return true;
+                    break;
+
+                case OP_CALL:
+                case OP_CALLRET:
+                case OP_TAILCALL:
+                case OP_RET:
+                case OP_HALT:
+                case OP_ADDRET:
+                    return true;
+
+                default:
+                    if (writes(bc) && bc.reg1 == r)
+                        return true;
+                    break;
+            }
+        }
+        return true;
+    }
+
+    /* Push the superinstruction for `bc` followed by a push of its register */
+    static bool
+    fuse (const Bytecode& bc, std::vector<Bytecode>& out)
+    {
+        switch (bc.op) {
+            case OP_MOVEINT:
+                out.push_back(Bytecode(OP_PUSHINT, bc.operand));
+                return true;
+
+            case OP_MOVESTR:
+            case OP_MOVESYM:
+                out.push_back(Bytecode(OP_PUSHCONST, bc.operand));
+                return true;
+
+            case OP_LOADINT:
+            case OP_LOADSTR:
+            case OP_LOADSYM:
+            case OP_LOAD:
+                out.push_back(Bytecode(OP_PUSHLOAD, bc.operand));
+                return true;
+
+            default:
+                return false;
+        }
+    }
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <cassert>
 #include <string>
+#include "atom.hpp"
 
 typedef enum {
     PRM_NULL,
@@ -12,50 +13,65 @@ typedef enum {
     NUM_PRM
 } PrimitiveType;
 
+/*
+ * A constant as the compiler sees it. Strings and symbols are kept as their
+ * atom, so copying and comparing them is as cheap as it is for integers.
+ */
 struct Primitive
 {
-    Primitive () : _type(PRM_NULL) {}
-    Primitive (std::string s) : _type(PRM_STRING), _string(s) {}
+    Primitive () : _type(PRM_NULL), _integer(0) {}
+    Primitive (const std::string& s)
+        : _type(PRM_STRING), _atom(Atoms::intern(s)) {}
     Primitive (unsigned long v) : _type(PRM_INTEGER), _integer(v) {}
-    Primitive (PrimitiveType type, std::string s) : _type(type), _string(s) {}
+    Primitive (PrimitiveType type, const std::string& s)
+        : _type(type), _atom(Atoms::intern(s)) {}
+    Primitive (PrimitiveType type, Atom atom) : _type(type), _atom(atom) {}
 
     PrimitiveType
-    type ()
+    type () const
     {
         return _type;
     }
 
-    std::string
-    symbol ()
+    const std::string&
+    symbol () const
     {
         assert(_type == PRM_SYMBOL);
-        return _string;
+        return Atoms::name(_atom);
     }
 
-    std::string
-    string ()
+    const std::string&
+    string () const
     {
         assert(_type == PRM_STRING);
-        return _string;
+        return Atoms::name(_atom);
+    }
+
+    /* The atom of a string or symbol */
+    Atom
+    atom () const
+    {
+        assert(_type == PRM_STRING || _type == PRM_SYMBOL);
+        return _atom;
     }
 
     unsigned long
-    integer ()
+    integer () const
     {
         assert(_type == PRM_INTEGER);
         return _integer;
     }
 
     std::string
-    toString ()
+    toString () const
     {
         switch (_type) {
             case PRM_SYMBOL:
-                return _string;
+                return symbol();
                 break;
 
             case PRM_STRING:
-                return "\"" + _string + "\"";
+                return "\"" + string() + "\"";
                 break;
 
             case PRM_INTEGER:
@@ -76,8 +92,10 @@ struct Primitive
 
 protected:
     PrimitiveType _type;
-    std::string _string;
-    unsigned long _integer;
+    union {
+        Atom _atom;
+        unsigned long _integer;
+    };
 
 };
 
@@ -3,7 +3,9 @@
 
 #include <string>
 #include <vector>
+#include <algorithm>
 #include "ir.hpp"
+#include "tier.hpp"
 
 /*
  * The procedure owns information about the given IR. This information includes
@@ -14,18 +16,245 @@
 class Procedure
 {
 public:
+    Procedure ()
+        : name("")
+        , num_args(0)
+        , ir(IR(""))
+        , entry(0)
+        , version(0)
+        , pure(false)
+        , verified(false)
+        , returns(-1)
+        , depth(0)
+        , size(0)
+        , entries(0)
+        , backedges(0)
+        , native(NULL)
+        , tiered(false)
+    {}
+
     Procedure (std::string name, unsigned num_args, IR ir)
         : name(name)
         , num_args(num_args)
         , ir(ir)
+        , entry(0)
+        , version(0)
+        , pure(false)
+        , verified(false)
+        , returns(-1)
+        , depth(0)
+        , size(0)
+        , entries(0)
+        , backedges(0)
+        , native(NULL)
+        , tiered(false)
+    {}
+
+    /* A procedure whose bytecode lives in the Machine starting at `entry` */
+    Procedure (std::string name, unsigned long entry, unsigned long num_args)
+        : name(name)
+        , num_args(num_args)
+        , ir(IR(""))
+        , entry(entry)
+        , version(0)
+        , pure(false)
+        , verified(false)
+        , returns(-1)
+        , depth(0)
+        , size(0)
+        , entries(0)
+        , backedges(0)
+        , native(NULL)
+        , tiered(false)
     {}
 
     std::string
-    getName ()
+    getName () const
     {
         return name;
     }
 
+    /*
+     * The name native code refers to the procedure by. It stays the same
+     * across redefinitions and is unique among every Machine's procedures.
+     */
+    std::string
+    getSymbol () const
+    {
+        return symbol;
+    }
+
+    void
+    setSymbol (std::string symbol)
+    {
+        this->symbol = symbol;
+    }
+
+    unsigned
+    getNumArgs () const
+    {
+        return num_args;
+    }
+
+    unsigned long
+    getEntry () const
+    {
+        return entry;
+    }
+
+    /*
+     * The number of times this procedure has been defined. Zero means the
+     * name has been referenced but never defined.
+     */
+    unsigned long
+    getVersion () const
+    {
+        return version;
+    }
+
+    /*
+     * Whether the procedure was declared free of side effects, so calls to
+     * it with constant arguments may be evaluated at compile time.
+     */
+    bool
+    isPure () const
+    {
+        return pure;
+    }
+
+    /* The number of instructions in the body */
+    unsigned long
+    getSize () const
+    {
+        return size;
+    }
+
+    /*
+     * Point the procedure at a new body of `size` instructions, invalidating
+     * cached call targets. The new body starts out interpreted.
+     */
+    void
+    redefine (unsigned long entry,
+              unsigned long size,
+              unsigned long num_args,
+              bool pure)
+    {
+        this->entry = entry;
+        this->size = size;
+        this->num_args = num_args;
+        this->pure = pure;
+        this->verified = false;
+        this->returns = -1;
+        this->depth = 0;
+        this->entries = 0;
+        this->backedges = 0;
+        this->native = NULL;
+        this->tiered = false;
+        version++;
+    }
+
+    /* The body was moved to `entry` as it was, so nothing else changes */
+    void
+    relocate (unsigned long entry)
+    {
+        this->entry = entry;
+    }
+
+    /*
+     * Count a call to the body, or a tail call, which is how procedures loop.
+     * Returns whether the body has just become hot enough to be tiered up
+     * after `threshold` of them.
+     */
+    bool
+    enter (bool backedge, unsigned long threshold)
+    {
+        if (backedge)
+            backedges++;
+        else
+            entries++;
+        if (tiered || entries + backedges < threshold)
+            return false;
+        tiered = true;
+        return true;
+    }
+
+    unsigned long
+    getEntries () const
+    {
+        return entries;
+    }
+
+    unsigned long
+    getBackedges () const
+    {
+        return backedges;
+    }
+
+    /* The native code for the body, or NULL while it is interpreted */
+    NativeProcedure
+    getNative () const
+    {
+        return native;
+    }
+
+    /* Swap in native code for later calls */
+    void
+    promote (NativeProcedure native)
+    {
+        this->native = native;
+        this->tiered = true;
+        version++;
+    }
+
+    /* Go back to interpreting the body */
+    void
+    demote ()
+    {
+        if (!native)
+            return;
+        native = NULL;
+        version++;
+    }
+
+    /*
+     * Whether the body was verified, in which case it returns `getReturns`
+     * values (or -1 if unknown) and never has more than `getDepth` values in
+     * its frame.
+     */
+    bool
+    isVerified () const
+    {
+        return verified;
+    }
+
+    int
+    getReturns () const
+    {
+        return returns;
+    }
+
+    unsigned long
+    getDepth () const
+    {
+        return depth;
+    }
+
+    void
+    verify (int returns, unsigned long depth)
+    {
+        this->verified = true;
+        this->returns = returns;
+        this->depth = depth;
+    }
+
+    /* The body may no longer behave as verified */
+    void
+    unverify ()
+    {
+        verified = false;
+        returns = -1;
+    }
+
     std::string
     getIRString ()
     {
@@ -39,6 +268,14 @@ public:
         callers.push_back(name);
     }
 
+    /* Forget a caller, e.g. as it was redefined */
+    void
+    removeCaller (std::string name)
+    {
+        callers.erase(std::remove(callers.begin(), callers.end(), name),
+                callers.end());
+    }
+
     /* Add a procedure which this procedure calls */
     void
     addCallee (std::string name)
@@ -46,6 +283,24 @@ public:
         callees.push_back(name);
     }
 
+    void
+    clearCallees ()
+    {
+        callees.clear();
+    }
+
+    const std::vector<std::string>&
+    getCallers () const
+    {
+        return callers;
+    }
+
+    const std::vector<std::string>&
+    getCallees () const
+    {
+        return callees;
+    }
+
     /* 
      * Add an instrumentation function either before the procedure is called,
      * after it has been called.
@@ -57,8 +312,20 @@ public:
 
 protected:
     std::string name;
+    std::string symbol;
     unsigned num_args;
     IR ir;
+    unsigned long entry;
+    unsigned long version;
+    bool pure;
+    bool verified;
+    int returns;
+    unsigned long depth;
+    unsigned long size;
+    unsigned long entries;
+    unsigned long backedges;
+    NativeProcedure native;
+    bool tiered;
     std::vector<std::string> callers;
     std::vector<std::string> callees;
 };
@@ -0,0 +1,208 @@
+#ifndef SCRIBBLE_REGION
+#define SCRIBBLE_REGION
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "error.hpp"
+
+/* Bytes committed at once as a region grows */
+#define REGION_CHUNK (64 * 1024)
+
+/* Regions which may be alive at once */
+#define REGION_MAX 256
+
+/*
+ * A range of memory which grows without moving. All of it is reserved up
+ * front, but pages are only committed as they are first touched: touching
+ * one past those committed faults, and the SIGSEGV handler commits more and
+ * lets the access go ahead. A guard page past the end is never committed, so
+ * that running off the end is an overflow rather than a write to whatever
+ * follows.
+ *
+ * Memory is zeroed when it is committed, as the kernel hands it out.
+ */
+class Region
+{
+public:
+    /* Reserve `size` bytes, failing with `overflow` once they are used up */
+    Region (size_t size, const char *overflow)
+        : committed(0)
+        , overflow(overflow)
+    {
+        page = sysconf(_SC_PAGESIZE);
+        this->size = (size + page - 1) / page * page;
+        base = (char*) mmap(NULL, this->size + page, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED)
+            fatal("Region: cannot reserve %zu bytes", this->size);
+
+        if (!commit(base))
+            fatal("Region: cannot commit %zu bytes", (size_t) REGION_CHUNK);
+        install();
+
+        for (slot = 0; slot < REGION_MAX; slot++) {
+            Region *empty = NULL;
+            if (regions()[slot].compare_exchange_strong(empty, this))
+                break;
+        }
+        if (slot == REGION_MAX)
+            fatal("Region: more than %d regions", REGION_MAX);
+    }
+
+    ~Region ()
+    {
+        regions()[slot].store(NULL);
+        munmap(base, size + page);
+    }
+
+    /* The region's address never changes, so neither may it be copied */
+    Region (const Region&) = delete;
+    Region& operator= (const Region&) = delete;
+
+    void*
+    start () const
+    {
+        return base;
+    }
+
+    /* The address just past the last usable byte */
+    void*
+    end () const
+    {
+        return base + size;
+    }
+
+    size_t
+    getSize () const
+    {
+        return size;
+    }
+
+    /* How many bytes have been committed so far */
+    size_t
+    getCommitted () const
+    {
+        return committed;
+    }
+
+protected:
+    char *base;
+    size_t size;
+    size_t page;
+    size_t committed;
+    const char *overflow;
+    unsigned long slot;
+
+    /*
+     * Commit the chunks up to and including the byte at `address`. This runs
+     * in the handler, so it only reports whether it could.
+     */
+    bool
+    commit (const char *address)
+    {
+        size_t upto = (address - base) / REGION_CHUNK * REGION_CHUNK
+                    + REGION_CHUNK;
+        if (upto > size)
+            upto = size;
+        if (mprotect(base + committed, upto - committed,
+                    PROT_READ | PROT_WRITE) != 0)
+            return false;
+        committed = upto;
+        return true;
+    }
+
+    /*
+     * Every region alive, for the handler to look through. Slots are claimed
+     * and cleared atomically, so the handler never sees one half-linked.
+     */
+    static std::atomic<Region*>*
+    regions ()
+    {
+        static std::atomic<Region*> slots[REGION_MAX];
+        return slots;
+    }
+
+    static struct sigaction&
+    previous ()
+    {
+        static struct sigaction action;
+        return action;
+    }
+
+    /*
+     * Install the handler once. It runs on a stack of its own, as the fault
+     * may just as well come from the process running out of its own.
+     */
+    static void
+    install ()
+    {
+        static bool installed = false;
+        if (installed)
+            return;
+        installed = true;
+
+        static char altstack[65536];
+        stack_t ss;
+        ss.ss_sp = altstack;
+        ss.ss_size = sizeof(altstack);
+        ss.ss_flags = 0;
+        sigaltstack(&ss, NULL);
+
+        struct sigaction action;
+        action.sa_sigaction = fault;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigaction(SIGSEGV, &action, &previous());
+    }
+
+    /* Give up from within the handler, where stdio may not be used */
+    static void
+    die (const char *message)
+    {
+        ssize_t written = write(STDERR_FILENO, message, strlen(message));
+        written = write(STDERR_FILENO, "\n", 1);
+        (void) written;
+        _exit(1);
+    }
+
+    /*
+     * Grow the region the faulting address is in, if any, and return so the
+     * access is retried. A fault in a region's guard page is an overflow.
+     * Faults outside every region go on to the previous handler; if that was
+     * the default, it is put back and the access retried to fault for real.
+     */
+    static void
+    fault (int signal, siginfo_t *info, void *context)
+    {
+        char *address = (char*) info->si_addr;
+        for (unsigned long i = 0; i < REGION_MAX; i++) {
+            Region *r = regions()[i].load();
+            if (!r || address < r->base
+                   || address >= r->base + r->size + r->page)
+                continue;
+            if (address >= r->base + r->size)
+                die(r->overflow);
+            if (address >= r->base + r->committed) {
+                if (!r->commit(address))
+                    die("Region: cannot commit memory");
+                return;
+            }
+            break;
+        }
+
+        struct sigaction& old = previous();
+        if (old.sa_flags & SA_SIGINFO)
+            old.sa_sigaction(signal, info, context);
+        else if (old.sa_handler == SIG_DFL || old.sa_handler == SIG_IGN)
+            ::signal(SIGSEGV, SIG_DFL);
+        else
+            old.sa_handler(signal);
+    }
+};
+
+#endif
@@ -2,59 +2,56 @@
 #define SCRIBBLE_JIT
 
 #include <string>
-#include <stack>
 
 #include "llvm.hpp"
 #include "ir.hpp"
 #include "procedure.hpp"
 #include "primitive.hpp"
 
-static std::stack<PrimitiveType> _typestack;
-
-extern "C" {
-    void
-    typestack_pushInteger ()
-    {
-        _typestack.push(PRM_INTEGER);
-    }
-
-    void
-    typestack_pushString ()
-    {
-        _typestack.push(PRM_STRING);
-    }
-}
-
-class Runtime
+/*
+ * The Runtime is also the tier the Machine compiles hot procedures with, which
+ * are optimized at `level`. Procedures executed straight away are run once,
+ * so they are barely optimized.
+ */
+class Runtime : public NativeTier
 {
 protected:
     LLVM llvm;
     IR globals;
     IR externals;
+    OptLevel level;
 
 public:
-    Runtime ()
+    /* Compile on a pool of `threads`, by default one per core */
+    Runtime (unsigned threads = 0)
+        : llvm(threads)
         /*
          * Define the values which should exist in all LLVM modules, e.g. the
          * stack, and the external declarations that are needed to access them
          * in each module.
          */
-        : globals(IR(
+        , globals(IR(
             "@stack = global [4096 x i64] zeroinitializer, align 16\n"
+            "@types = global [4096 x i8] zeroinitializer, align 16\n"
             "@top = global i64* getelementptr inbounds ([4096 x i64], [4096 x i64]* @stack, i32 0, i32 0), align 8\n"
         ))
         , externals(IR(
             "@stack = external global [4096 x i64]\n"
+            "@types = external global [4096 x i8]\n"
             "@top = external global i64*\n"
-            "declare void @typestack_pushInteger ()\n"
-            "declare void @typestack_pushString ()\n"
+            "declare i64* @scribble_push (i64*, i64)\n"
+            "declare i64* @scribble_pop (i64*)\n"
+            "declare void @scribble_tag (i64*, i8)\n"
         ))
+        , level(OPT_DEFAULT)
 
     {
         /*
-         * Initialize global state in the JIT.
+         * Initialize global state in the JIT and parse the declarations every
+         * module needs once, rather than with every procedure.
          */
         defineIR(globals);
+        llvm.declare(externals.getString());
     }
 
     void
@@ -66,7 +63,106 @@ public:
     void
     executeProcedure (Procedure &p)
     {
-        llvm.execute(p.getName(), externals.getString() + p.getIRString());
+        llvm.execute(p.getName(), p.getIRString());
+    }
+
+    NativeProcedure
+    compile (const std::string& symbol, const NativeBody& body)
+    {
+        return (NativeProcedure) llvm.compile(symbol, body, level);
+    }
+
+    /*
+     * Build the procedures in `bodies` into an executable at `path` which
+     * runs `entry` with the stack the globals define, or an object if `path`
+     * ends in ".o".
+     */
+    bool
+    build (const std::map<std::string, NativeBody>& bodies,
+           std::string entry,
+           std::string path)
+    {
+        return llvm.build(bodies, entry, globals.getString(), path);
+    }
+
+    void
+    cluster (const std::string& root,
+             const std::map<std::string, NativeBody>& bodies)
+    {
+        llvm.cluster(root, bodies, level);
+    }
+
+    /* Wait for the clusters being compiled in the background */
+    void
+    settle ()
+    {
+        llvm.settle();
+    }
+
+    /* How many clusters are in place of their roots */
+    unsigned long
+    getClusters ()
+    {
+        return llvm.getClusters();
+    }
+
+    void
+    setOptLevel (OptLevel level)
+    {
+        this->level = level;
+    }
+
+    void
+    interpret (const std::string& symbol)
+    {
+        llvm.interpret(symbol);
+    }
+
+    /*
+     * Keep what is compiled in `directory` so that later runs load it rather
+     * than compile it again, in at most `capacity` bytes.
+     */
+    bool
+    setCache (std::string directory, unsigned long capacity)
+    {
+        return llvm.setCache(directory, capacity);
+    }
+
+    void
+    clearCache ()
+    {
+        llvm.clearCache();
+    }
+
+    unsigned long
+    getCacheHits ()
+    {
+        return llvm.getCacheHits();
+    }
+
+    unsigned long
+    getCacheMisses ()
+    {
+        return llvm.getCacheMisses();
+    }
+
+    void
+    setTimePasses (bool time)
+    {
+        llvm.setTimePasses(time);
+    }
+
+    std::map<std::string, double>
+    getPassTimes ()
+    {
+        return llvm.getPassTimes();
+    }
+
+    /* Print the IR of everything compiled from now on, for debugging */
+    void
+    dumpIR (bool dump)
+    {
+        llvm.setDump(dump);
     }
 
     unsigned long*
@@ -75,10 +171,11 @@ public:
         return llvm.getStack();
     }
 
-    std::stack<PrimitiveType>&
-    getTypestack ()
+    /* The type of each value on the stack, as a PrimitiveType */
+    unsigned char*
+    getTypes ()
     {
-        return _typestack;
+        return llvm.getTypes();
     }
 };
 
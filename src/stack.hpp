@@ -4,90 +4,109 @@
 #include <assert.h>
 #include "data.hpp"
 #include "error.hpp"
+#include "region.hpp"
+
+/*
+ * The values and calls a stack has room for. Only as much of either as is
+ * used is ever committed.
+ */
+#define STACK_SIZE (1UL << 20)
+#define STACK_FRAMES (1UL << 18)
+
+/*
+ * Where a call returns to. The callee's frame starts at `floor` on the stack
+ * and `base` is the caller's REGBASE.
+ */
+struct Activation
+{
+    unsigned long ret;
+    unsigned long base;
+    unsigned long floor;
+};
 
 /*
  * Byte-addressable stack implementation.
  *
- * The stack as a reserved area for instructions and a regular push/pop stack
- * for scratch values during execution.
+ * A regular push/pop stack for scratch values during execution. Instructions
+ * live in the CodeHeap. The return address and base of each call are kept
+ * apart from the values, on a control stack.
+ *
+ * Values and calls live in Regions, which grow as they are used without ever
+ * moving, so that native code may keep pointers into the stack. Pushing
+ * needs no bounds check, as pushing past the end faults on the Region's
+ * guard page.
  */
 
 class Stack
 {
 public:
     Stack ()
+        : values(STACK_SIZE * sizeof(Data), "Push: stack overflow")
+        , activations(STACK_FRAMES * sizeof(Activation),
+                "Call: frame stack overflow")
     {
-        num_reserved = 1024;
-        reserved_idx = 0;
+        stack_size = STACK_SIZE;
+        stack_idx = 0;
 
-        stack_size = 4096;
-        stack_idx = num_reserved;
+        num_frames = STACK_FRAMES;
+        frame_idx = 0;
 
-        assert(num_reserved > 0);
-        assert(stack_size > num_reserved);
+        assert(stack_size > 0);
+        assert(num_frames > 0);
 
-        stack = new Data[stack_size];
+        stack = (Data*) values.start();
+        frames = (Activation*) activations.start();
     }
 
-    ~Stack ()
+    /* An overflow faults, see Region */
+    void
+    push (Data data)
     {
-        delete[] stack;
+        stack[stack_idx] = data;
+        stack_idx++;
     }
 
-    /*
-     * Index into the reserved portion of the stack as if it were an array with
-     * 0-indexing.
-     */
-    Data*
-    reserved (unsigned long idx)
+    Data
+    pop ()
     {
-        return stack + idx;
+        if (stack_idx == 0)
+            fatal("Pop: stack underflow");
+        stack_idx--;
+        Data data = stack[stack_idx];
+        stack[stack_idx] = Data();
+        return data;
     }
 
-    unsigned long
-    reserveIndex ()
+    /*
+     * Variants of the above without underflow checks, for code which has
+     * been verified to stay within a frame for which room was reserved.
+     */
+    void
+    pushUnchecked (Data data)
     {
-        return reserved_idx;
+        stack[stack_idx++] = data;
     }
 
-    void
-    reserveRollback (unsigned long idx)
+    Data
+    popUnchecked ()
     {
-        reserved_idx = idx;
+        Data data = stack[--stack_idx];
+        stack[stack_idx] = Data();
+        return data;
     }
 
-    void
-    reservePush (Data data)
+    Data
+    peekUnchecked (signed long num)
     {
-        if (reserved_idx >= num_reserved)
-            fatal("PushReserved: stack overflow");
-        stack[reserved_idx].assign(data);
-        reserved_idx++;
+        return stack[stack_idx + num - 1];
     }
 
+    /* Make sure `n` more values may be pushed */
     void
-    push (Data data)
+    reserve (unsigned long n)
     {
-        /*
-         * We don't grow the stack right now to ensure the stack's memory
-         * addresses always remain the same for the duration of the program
-         * due to issues with pointer aliasing. We do an assert here, but TODO
-         * should be a stack-overflow interrupt.
-        */
-        if (stack_idx >= stack_size)
+        if (stack_idx + n > stack_size)
             fatal("Push: stack overflow");
-        stack[stack_idx].assign(data);
-        stack_idx++;
-    }
-
-    Data
-    pop ()
-    {
-        if (stack_idx == num_reserved)
-            fatal("Pop: stack underflow");
-        stack[stack_idx].assign(0);
-        stack_idx--;
-        return stack[stack_idx];
     }
 
     /*
@@ -102,10 +121,75 @@ public:
         return stack[stack_idx + num - 1];
     }
 
+    /* Absolutely address a value below the top of the stack */
+    Data
+    get (unsigned long idx)
+    {
+        assert(idx < stack_idx);
+        return stack[idx];
+    }
+
+    void
+    set (unsigned long idx, Data data)
+    {
+        assert(idx < stack_idx);
+        stack[idx] = data;
+    }
+
+    /* Pop everything at and above `idx` */
+    void
+    truncate (unsigned long idx)
+    {
+        assert(idx <= stack_idx);
+        while (stack_idx > idx) {
+            stack_idx--;
+            stack[stack_idx] = Data();
+        }
+    }
+
     bool
     empty ()
     {
-        return (stack_idx == num_reserved);
+        return (stack_idx == 0);
+    }
+
+    void
+    pushFrame (Activation frame)
+    {
+        frames[frame_idx] = frame;
+        frame_idx++;
+    }
+
+    Activation
+    popFrame ()
+    {
+        if (frame_idx == 0)
+            fatal("Ret: frame stack underflow");
+        frame_idx--;
+        return frames[frame_idx];
+    }
+
+    /* Drop the calls above the `depth` outermost, which never returned */
+    void
+    unwind (unsigned long depth)
+    {
+        assert(depth <= frame_idx);
+        frame_idx = depth;
+    }
+
+    /* The frame of the running procedure, which must have been called */
+    Activation&
+    topFrame ()
+    {
+        assert(frame_idx > 0);
+        return frames[frame_idx - 1];
+    }
+
+    /* The number of calls which have not returned */
+    unsigned long
+    depth ()
+    {
+        return frame_idx;
     }
 
     unsigned long
@@ -114,12 +198,40 @@ public:
         return stack_idx;
     }
 
+    /*
+     * The address just past the top of the stack, as native code sees it.
+     * Native code moves the top itself and hands it back with `setTop`.
+     */
+    uint64_t*
+    top ()
+    {
+        return (uint64_t*) (stack + stack_idx);
+    }
+
+    /* The address just past the end of the stack */
+    const uint64_t*
+    limit ()
+    {
+        return (uint64_t*) (stack + stack_size);
+    }
+
+    void
+    setTop (uint64_t *top)
+    {
+        Data *data = (Data*) top;
+        assert(data >= stack && data <= stack + stack_size);
+        stack_idx = data - stack;
+    }
+
 protected:
+    Region values;
+    Region activations;
     Data* stack;
+    Activation* frames;
     unsigned stack_size;
     unsigned stack_idx;
-    unsigned num_reserved;
-    unsigned reserved_idx;
+    unsigned num_frames;
+    unsigned frame_idx;
 };
 
 #endif
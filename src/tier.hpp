@@ -0,0 +1,80 @@
+#ifndef SCRIBBLE_TIER
+#define SCRIBBLE_TIER
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include "bytecode.hpp"
+#include "data.hpp"
+
+/*
+ * A procedure compiled to native code. It is given the top of the data stack,
+ * with its arguments just below, the Machine to call back into and the call
+ * site it was called through. It returns the new top, with its return value
+ * (if any) where its first argument was.
+ *
+ * Native code calls procedures through stubs of this type. The stub of a
+ * procedure which isn't native leads to `machine_call`, which interprets it
+ * as the call site says.
+ */
+typedef uint64_t* (*NativeProcedure) (uint64_t *top,
+                                      void *machine,
+                                      uint64_t site);
+
+/*
+ * What the Machine hands a tier to compile: the `size` instructions of a
+ * verified procedure taking `nargs` arguments, whose frame never holds more
+ * than `depth` values, nor goes past `limit` on the stack. Operands index the
+ * Machine's `constants`, `folds` maps the offset of each FOLD to the offset it
+ * skips to and `callees` maps the offset of each call to the callee's symbol.
+ * `tails` maps the offset of each call in tail position whose callee returns
+ * exactly one value to the number of arguments it passes, as the caller's
+ * frame may then be given to the callee.
+ */
+struct NativeBody
+{
+    const Bytecode *code;
+    unsigned long size;
+    unsigned long nargs;
+    unsigned long depth;
+    const std::vector<Data> *constants;
+    const uint64_t *limit;
+    std::map<unsigned long, unsigned long> folds;
+    std::map<unsigned long, std::string> callees;
+    std::map<unsigned long, unsigned long> tails;
+};
+
+/*
+ * Somewhere to compile procedures the Machine finds hot. The Machine only
+ * knows of this interface so that it may run without a JIT.
+ */
+class NativeTier
+{
+public:
+    virtual ~NativeTier ()
+    {}
+
+    /*
+     * Compile `body` and point the stub for the procedure `symbol` at it.
+     * Returns the stub, or NULL if the body can't be compiled.
+     */
+    virtual NativeProcedure compile (const std::string& symbol,
+                                     const NativeBody& body) = 0;
+
+    /* Point the stub for `symbol` back at the interpreter */
+    virtual void interpret (const std::string& symbol) = 0;
+
+    /*
+     * The native procedure `root` calls those in `bodies`, which include it,
+     * by symbol. A tier may compile them together, inlining calls between
+     * them, and point the stub for `root` at the result for as long as none
+     * of them is compiled again or interpreted.
+     */
+    virtual void
+    cluster (const std::string& root,
+             const std::map<std::string, NativeBody>& bodies)
+    {}
+};
+
+#endif
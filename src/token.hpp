@@ -1,6 +1,9 @@
 #ifndef SCRIBBLE_TOKEN
 #define SCRIBBLE_TOKEN
 
+#include <cerrno>
+#include <cstdlib>
+#include "data.hpp"
 #include "error.hpp"
 #include "primitive.hpp"
 
@@ -15,51 +18,80 @@ typedef enum {
     TKN_EOF,
 } TokenType;
 
-//static const char *
-//tokenTypeString (TokenType type)
-//{
-//    switch (type) {
-//        case TKN_STRING:  return "<String>";
-//        case TKN_INTEGER: return "<Integer>";
-//        case TKN_FLOAT:   return "<Float>";
-//        case TKN_SYMBOL:  return "<Symbol>";
-//        case TKN_LPAREN:  return "<(>";
-//        case TKN_RPAREN:  return "<)>";
-//        case TKN_INVALID:
-//        default:          return "!!BAD TYPE!!";
-//    }
-//}
+static inline const char *
+tokenTypeString (TokenType type)
+{
+    switch (type) {
+        case TKN_STRING:  return "<String>";
+        case TKN_INTEGER: return "<Integer>";
+        case TKN_FLOAT:   return "<Float>";
+        case TKN_SYMBOL:  return "<Symbol>";
+        case TKN_LPAREN:  return "<(>";
+        case TKN_RPAREN:  return "<)>";
+        case TKN_INVALID:
+        default:          return "!!BAD TYPE!!";
+    }
+}
 
+/*
+ * Strings and symbols are interned as they are read, into `atom`, and
+ * integers are parsed into `integer`; the text is looked up when needed.
+ * Integers must fit in a Data, see Data::INTEGER_MAX.
+ */
 struct Token
 {
     TokenType type;
-    std::string str;
+    union {
+        Atom atom;
+        unsigned long integer;
+    };
 
     Token ()
         : type(TKN_INVALID)
-        , str("")
+        , integer(0)
     {
     }
 
     Token (TokenType type)
         : type(type)
-        , str("")
+        , integer(0)
     {
     }
 
-    Token (TokenType type, std::string str)
+    Token (TokenType type, const std::string& text)
         : type(type)
-        , str(str)
+        , integer(0)
+    {
+        if (type == TKN_STRING || type == TKN_SYMBOL)
+            atom = Atoms::intern(text);
+        else if (type == TKN_INTEGER) {
+            errno = 0;
+            integer = strtoul(text.c_str(), NULL, 10);
+            if (errno == ERANGE || integer > Data::INTEGER_MAX)
+                fatal("Integers cannot be greater than %lu: `%s'",
+                        Data::INTEGER_MAX, text.c_str());
+        }
+    }
+
+    /* The token as it was written, give or take leading zeroes */
+    std::string
+    text () const
     {
+        switch (type) {
+            case TKN_STRING:
+            case TKN_SYMBOL:  return Atoms::name(atom);
+            case TKN_INTEGER: return std::to_string(integer);
+            default:          return "";
+        }
     }
 
     Primitive
     toPrimitive ()
     {
         switch (type) {
-            case TKN_STRING:  return Primitive(str);
-            case TKN_INTEGER: return Primitive(std::stoul(str));
-            case TKN_SYMBOL:  return Primitive(PRM_SYMBOL, str);
+            case TKN_STRING:  return Primitive(PRM_STRING, atom);
+            case TKN_INTEGER: return Primitive(integer);
+            case TKN_SYMBOL:  return Primitive(PRM_SYMBOL, atom);
             default:
                 fatal("Unimplemented token -> primitive conversion! `%d'", type);
         }
@@ -0,0 +1,323 @@
+#ifndef SCRIBBLE_VERIFIER
+#define SCRIBBLE_VERIFIER
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "code.hpp"
+
+/*
+ * What a call does to the stack: it takes `nargs` values and leaves
+ * `returns` in their place, which is -1 if it may leave either none or one.
+ * Calls whose arity isn't `known` cannot be verified.
+ */
+struct Arity
+{
+    bool known;
+    unsigned long nargs;
+    int returns;
+};
+
+/*
+ * The result of verifying a procedure. If `ok`, its frame never holds more
+ * than `depth` values and instructions marked `unchecked` need no runtime
+ * checks, provided that every call has the arity it was verified against.
+ */
+struct Verification
+{
+    bool ok;
+    unsigned long depth;
+    int returns;
+    std::vector<bool> unchecked;
+};
+
+/*
+ * Walk a procedure's instructions once, tracking the depth of its frame and
+ * the types of the values in it. Control only ever moves forward, to the end
+ * of a FOLD or out of the procedure, so a single pass merging the state at
+ * the end of each fold is enough.
+ *
+ * The depth is kept as a range [lo, hi] because calls may return nothing.
+ * The types of the bottom `lo` values are known where they were pushed by
+ * the procedure itself, and the top of the stack is only known when the
+ * range is exact.
+ */
+class Verifier
+{
+public:
+    Verifier (const Code& code,
+              unsigned long nargs,
+              const std::vector<Arity>& arities)
+        : _code(code)
+        , _nargs(nargs)
+        , _arities(arities)
+    {}
+
+    Verification
+    verify ()
+    {
+        const std::vector<Bytecode>& in = _code.instructions();
+        Verification result = { true, _nargs, -2, {} };
+        std::map<unsigned long, State> pending;
+        State state;
+
+        state.live = true;
+        state.lo = state.hi = _nargs;
+        state.types.resize(_nargs, PRM_NULL);
+        for (int i = 0; i < REGCOUNT; i++)
+            state.regs[i] = PRM_NULL;
+
+        result.unchecked.resize(in.size(), false);
+
+        for (unsigned long i = 0; i < in.size() && result.ok; i++) {
+            const Bytecode& bc = in[i];
+
+            auto join = pending.find(i);
+            if (join != pending.end()) {
+                merge(state, join->second);
+                pending.erase(join);
+            }
+            if (!state.live)
+                continue;
+
+            result.unchecked[i] = true;
+            switch (bc.op) {
+                case OP_HALT:
+                    state.live = false;
+                    break;
+
+                case OP_MOVEINT:
+                    state.regs[bc.reg1] = PRM_INTEGER;
+                    break;
+
+                case OP_MOVESTR:
+                    state.regs[bc.reg1] = PRM_STRING;
+                    break;
+
+                case OP_MOVESYM:
+                    state.regs[bc.reg1] = PRM_SYMBOL;
+                    break;
+
+                case OP_LOADINT:
+                case OP_LOADSTR:
+                case OP_LOADSYM: {
+                    PrimitiveType type = loadType(bc.op);
+                    result.unchecked[i] =
+                        slot(state, (long) bc.operand) == type;
+                    state.regs[bc.reg1] = type;
+                    break;
+                }
+
+                case OP_LOAD:
+                    result.unchecked[i] = inFrame(state, (long) bc.operand);
+                    state.regs[bc.reg1] = slot(state, (long) bc.operand);
+                    break;
+
+                case OP_PUSH:
+                    push(state, state.regs[bc.reg1]);
+                    break;
+
+                case OP_POP:
+                    state.regs[bc.reg1] = top(state, 0);
+                    result.ok = pop(state, 1);
+                    break;
+
+                case OP_CALL:
+                case OP_TAILCALL:
+                    result.ok = call(state, _arities[i]);
+                    break;
+
+                case OP_CALLRET:
+                    result.ok = call(state, _arities[i]);
+                    ret(state, result);
+                    break;
+
+                case OP_RET:
+                    ret(state, result);
+                    break;
+
+                case OP_ADD:
+                    result.ok = pop(state, 2);
+                    push(state, PRM_INTEGER);
+                    break;
+
+                case OP_ADDRET:
+                    result.ok = pop(state, 2);
+                    push(state, PRM_INTEGER);
+                    ret(state, result);
+                    break;
+
+                case OP_PRINT:
+                    result.ok = state.lo >= 1;
+                    break;
+
+                case OP_PUSHINT:
+                    push(state, PRM_INTEGER);
+                    break;
+
+                case OP_PUSHCONST:
+                    push(state, _code.constants()[bc.operand].type());
+                    break;
+
+                case OP_PUSHLOAD: {
+                    PrimitiveType type = slot(state, (long) bc.operand);
+                    result.unchecked[i] = inFrame(state, (long) bc.operand);
+                    push(state, type);
+                    break;
+                }
+
+                case OP_FOLD: {
+                    const Fold& fold = _code.folds()[bc.operand];
+                    State skipped = state;
+                    push(skipped, fold.value.type());
+                    merge(pending[fold.end], skipped);
+                    break;
+                }
+
+                default:
+                    result.ok = false;
+                    break;
+            }
+
+            if (state.hi > (long) result.depth)
+                result.depth = state.hi;
+        }
+
+        if (result.returns == -2)
+            result.returns = -1;
+        return result;
+    }
+
+protected:
+    struct State
+    {
+        bool live;
+        long lo, hi;
+        std::vector<PrimitiveType> types;
+        PrimitiveType regs[REGCOUNT];
+
+        State ()
+            : live(false)
+            , lo(0)
+            , hi(0)
+        {}
+    };
+
+    const Code& _code;
+    unsigned long _nargs;
+    const std::vector<Arity>& _arities;
+
+    static PrimitiveType
+    loadType (Operator op)
+    {
+        switch (op) {
+            case OP_LOADINT: return PRM_INTEGER;
+            case OP_LOADSTR: return PRM_STRING;
+            default:         return PRM_SYMBOL;
+        }
+    }
+
+    /* Push a value of `type`, which is lost if the depth isn't exact */
+    static void
+    push (State& state, PrimitiveType type)
+    {
+        state.types.push_back(state.lo == state.hi ? type : PRM_NULL);
+        state.lo++;
+        state.hi++;
+    }
+
+    /* Pop `n` values, failing if there might not be that many */
+    static bool
+    pop (State& state, long n)
+    {
+        if (state.lo < n)
+            return false;
+        state.lo -= n;
+        state.hi -= n;
+        state.types.resize(state.lo);
+        return true;
+    }
+
+    /* The type of the value `n` from the top, if known */
+    static PrimitiveType
+    top (const State& state, long n)
+    {
+        if (state.lo != state.hi || state.lo <= n)
+            return PRM_NULL;
+        return state.types[state.lo - n - 1];
+    }
+
+    /* Whether the value `load` addresses with `index` is within the frame */
+    static bool
+    inFrame (const State& state, long index)
+    {
+        if (index < 0)
+            return -index <= state.lo;
+        return index < state.lo;
+    }
+
+    /* The type of the value `load` addresses with `index`, if known */
+    static PrimitiveType
+    slot (const State& state, long index)
+    {
+        if (!inFrame(state, index))
+            return PRM_NULL;
+        if (index < 0)
+            return top(state, -index - 1);
+        return state.types[index];
+    }
+
+    static bool
+    call (State& state, const Arity& arity)
+    {
+        if (!arity.known || !pop(state, arity.nargs))
+            return false;
+        if (arity.returns != 0)
+            push(state, PRM_NULL);
+        if (arity.returns < 0) {
+            state.lo--;
+            state.types.resize(state.lo);
+        }
+        for (int i = 0; i < REGCOUNT; i++)
+            state.regs[i] = PRM_NULL;
+        return true;
+    }
+
+    /* Note what the frame returns and end this path */
+    static void
+    ret (State& state, Verification& result)
+    {
+        int returns = state.lo >= 1 ? 1 : (state.hi == 0 ? 0 : -1);
+        if (result.returns == -2)
+            result.returns = returns;
+        else if (result.returns != returns)
+            result.returns = -1;
+        state.live = false;
+    }
+
+    /* Join the state of another path into `state` */
+    static void
+    merge (State& state, const State& other)
+    {
+        if (!other.live)
+            return;
+        if (!state.live) {
+            state = other;
+            return;
+        }
+
+        unsigned long common = std::min(state.lo, other.lo);
+        state.types.resize(common);
+        for (unsigned long i = 0; i < common; i++)
+            if (state.types[i] != other.types[i])
+                state.types[i] = PRM_NULL;
+        for (int i = 0; i < REGCOUNT; i++)
+            if (state.regs[i] != other.regs[i])
+                state.regs[i] = PRM_NULL;
+
+        state.lo = common;
+        state.hi = std::max(state.hi, other.hi);
+    }
+};
+
+#endif
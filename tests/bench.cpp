@@ -0,0 +1,165 @@
+#include <chrono>
+#include <cstdio>
+#include <functional>
+
+#include "machine.hpp"
+
+/*
+ * Micro-benchmarks for the Machine. The Machine reports each definition on
+ * stdout, so results are written to stderr.
+ */
+
+#define WORK_ADDS  250
+#define WORK_CALLS 100
+#define ROUNDS     200
+
+#define SLOTS       3072
+#define SLOT_ROUNDS 20000
+
+static double
+seconds (std::function<void()> f)
+{
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+static void
+report (const char *name, unsigned long steps, double secs)
+{
+    fprintf(stderr, "%-24s %8.3f s %10.1f Minstr/s\n",
+            name, secs, steps / secs / 1e6);
+}
+
+/*
+ * Run a procedure of straight-line additions called repeatedly so that the
+ * cost of dispatch dominates.
+ */
+static void
+benchDispatch ()
+{
+    Machine machine;
+    Code work;
+    Code bench;
+
+    work.emit(Bytecode(OP_MOVEINT, REG1, 1));
+    work.emit(Bytecode(OP_PUSH, REG1));
+    for (int i = 0; i < WORK_ADDS; i++) {
+        work.emit(Bytecode(OP_MOVEINT, REG1, 1));
+        work.emit(Bytecode(OP_PUSH, REG1));
+        work.emit(Bytecode(OP_ADD));
+    }
+    work.emit(Bytecode(OP_RET));
+    machine.defineProcedure("work", 0, work);
+
+    uint64_t sym = bench.constant(Primitive(PRM_SYMBOL, "work"));
+    for (int i = 0; i < WORK_CALLS; i++) {
+        bench.emit(Bytecode(OP_CALL, sym));
+        bench.emit(Bytecode(OP_POP, REG1));
+    }
+    bench.emit(Bytecode(OP_HALT));
+    unsigned long entry = machine.defineProcedure("bench", 0, bench);
+
+    unsigned long steps =
+        ROUNDS * (WORK_CALLS * (3 * WORK_ADDS + 5) + 1);
+
+    machine.setDispatch(DISPATCH_SWITCH);
+    report("dispatch/switch", steps, seconds([&]() {
+        for (int i = 0; i < ROUNDS; i++)
+            machine.run(entry);
+    }));
+
+#ifdef SCRIBBLE_THREADED
+    /* the switch loop always checks, so compare it with checked threading */
+    machine.setDispatch(DISPATCH_THREADED);
+    machine.setChecked(true);
+    report("dispatch/threaded", steps, seconds([&]() {
+        for (int i = 0; i < ROUNDS; i++)
+            machine.run(entry);
+    }));
+
+    machine.setChecked(false);
+    report("dispatch/unchecked", steps, seconds([&]() {
+        for (int i = 0; i < ROUNDS; i++)
+            machine.run(entry);
+    }));
+#endif
+}
+
+/*
+ * The layout of a stack slot before values became tagged words: a type, a
+ * Primitive holding both a string and an integer, an instruction carrying a
+ * Primitive of its own, and an executable flag.
+ */
+struct BoxedData
+{
+    int type;
+    Primitive primitive;
+    struct {
+        Operator op;
+        Register reg1;
+        Register reg2;
+        Primitive primitive;
+    } bytecode;
+    bool is_executable;
+
+    BoxedData ()
+        : type(0)
+        , is_executable(false)
+    {}
+
+    BoxedData (unsigned long integer)
+        : type(1)
+        , primitive(Primitive(integer))
+        , is_executable(false)
+    {}
+
+    unsigned long
+    integer () const
+    {
+        return primitive.integer();
+    }
+};
+
+/*
+ * Fill and drain a fixed stack of `T` the way Stack::push and Stack::pop do,
+ * including the clearing of popped slots. Neither checks for overflow, as
+ * the stack's guard page does.
+ */
+template <typename T>
+static void
+benchSlots (const char *name)
+{
+    T *slots = new T[SLOTS];
+    unsigned long idx = 0;
+    unsigned long sum = 0;
+
+    double secs = seconds([&]() {
+        for (int r = 0; r < SLOT_ROUNDS; r++) {
+            for (unsigned long i = 0; i < SLOTS; i++) {
+                slots[idx++] = T(i);
+            }
+            while (idx > 0) {
+                idx--;
+                sum += slots[idx].integer();
+                slots[idx] = T();
+            }
+        }
+    });
+
+    unsigned long ops = 2UL * SLOTS * SLOT_ROUNDS;
+    fprintf(stderr, "%-24s %8.3f s %10.1f Mop/s %6zu bytes/slot (%lu)\n",
+            name, secs, ops / secs / 1e6, sizeof(T), sum);
+    delete[] slots;
+}
+
+int
+main (int argc, char **argv)
+{
+    benchDispatch();
+    benchSlots<BoxedData>("push-pop/boxed");
+    benchSlots<Data>("push-pop/tagged");
+    return 0;
+}
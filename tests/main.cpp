@@ -1,9 +1,27 @@
 #include "test.cpp"
 
+#include <sstream>
+#include <sys/wait.h>
+
+#include "cache.hpp"
 #include "ir.hpp"
 #include "irbuilder.hpp"
 #include "procedure.hpp"
 #include "runtime.hpp"
+#include "parse.hpp"
+#include "compile.hpp"
+
+/* Compile and execute one expression, returning the top of the stack */
+static Data
+evaluate (Machine& machine, std::string source, bool peephole = true)
+{
+    std::stringstream input(source);
+    Parse parse(input);
+    Compile compile(machine);
+    compile.setPeephole(peephole);
+    machine.execute(compile.tokens(parse.stream()));
+    return machine.peek(0);
+}
 
 BEGIN();
 
@@ -31,12 +49,566 @@ TEST(basicIntegerStackCheck)
     assert(stackptr[1] == 72);
     assert(stackptr[2] == 9);
 
-    auto typestack = runtime.getTypestack();
-    for (int i = 0; i < 3; i++) {
-        assert(typestack.top() == PRM_INTEGER);
-        typestack.pop();
+    auto types = runtime.getTypes();
+    for (int i = 0; i < 3; i++)
+        assert(types[i] == PRM_INTEGER);
+    assert(types[3] == PRM_NULL);
+
+    /* untagged code leaves the types be */
+    IRBuilder bump3;
+    bump3.setTagged(false);
+    bump3.pushInteger(4);
+    bump3.retvoid();
+    Procedure p3("foo", 0, bump3.buildFunc("foo"));
+    runtime.executeProcedure(p3);
+    assert(stackptr[3] == 4);
+    assert(types[3] == PRM_NULL);
+
+    /* popping clears the slots and their types */
+    IRBuilder drop;
+    drop.popInteger();
+    drop.popInteger();
+    drop.retvoid();
+    Procedure p4("foo", 0, drop.buildFunc("foo"));
+    runtime.executeProcedure(p4);
+    assert(stackptr[1] == 72);
+    assert(stackptr[2] == 0 && stackptr[3] == 0);
+    assert(types[1] == PRM_INTEGER && types[2] == PRM_NULL);
+};
+
+TEST(compiledObjectsAreCached)
+{
+    char directory[] = "/tmp/scribble-cache-XXXXXX";
+    assert(mkdtemp(directory));
+
+    Runtime runtime;
+    assert(runtime.setCache(directory, 1 << 20));
+
+    /* the globals may or may not have been compiled since */
+    unsigned long *stack = runtime.getStack();
+    unsigned long misses = runtime.getCacheMisses();
+
+    IRBuilder bump;
+    bump.pushInteger(5);
+    bump.retvoid();
+    Procedure p("bump", 0, bump.buildFunc("bump"));
+
+    runtime.executeProcedure(p);
+    assert(runtime.getCacheHits() == 0);
+    assert(runtime.getCacheMisses() == misses + 1);
+    runtime.executeProcedure(p);
+    assert(runtime.getCacheHits() == 1);
+    assert(stack[0] == 5 && stack[1] == 5);
+
+    runtime.clearCache();
+    runtime.executeProcedure(p);
+    assert(runtime.getCacheMisses() == misses + 2);
+
+    /* objects which don't fit are evicted as soon as they are compiled */
+    assert(runtime.setCache(directory, 1));
+    runtime.executeProcedure(p);
+    assert(runtime.getCacheHits() == 1);
+    assert(runtime.getCacheMisses() == misses + 3);
+    runtime.clearCache();
+
+    /* an object fetched before it is evicted is still there to compile */
+    DiskCache cache;
+    assert(cache.open(directory, 1 << 20));
+    llvm::LLVMContext context;
+    llvm::Module module("fetched", context);
+    DiskCache::setKey(module, "fetched");
+    cache.notifyObjectCompiled(&module, llvm::MemoryBufferRef("object", ""));
+    assert(cache.fetch("fetched"));
+    cache.clear();
+    auto object = cache.getObject(&module);
+    assert(object && object->getBuffer() == "object");
+    assert(cache.getHits() == 1 && !cache.getObject(&module));
+
+    rmdir(directory);
+};
+
+TEST(modulesAreOptimizedAtTheirLevel)
+{
+    Runtime runtime;
+    runtime.getStack();
+    runtime.setTimePasses(true);
+
+    /* code which is run once is barely optimized */
+    IRBuilder bump;
+    bump.pushInteger(5);
+    bump.retvoid();
+    Procedure p("bump", 0, bump.buildFunc("bump"));
+    runtime.executeProcedure(p);
+    assert(runtime.getPassTimes().count("InstCombinePass") == 0);
+
+    Machine machine;
+    machine.setTier(&runtime, 1);
+    evaluate(machine, "define(inc (a) add(a 1))");
+    assert(evaluate(machine, "inc(1)").integer() == 2);
+    assert(runtime.getPassTimes().count("InstCombinePass") == 1);
+};
+
+TEST(redefinitionInvalidatesCallSites)
+{
+    Machine machine;
+
+    /* `bar' is resolved before it is defined */
+    evaluate(machine, "define(foo () bar())");
+    evaluate(machine, "define(bar () 5)");
+    assert(evaluate(machine, "foo()").integer() == 5);
+
+    evaluate(machine, "define(bar () add(30 7))");
+    assert(evaluate(machine, "foo()").integer() == 37);
+    assert(evaluate(machine, "add(foo() foo())").integer() == 74);
+};
+
+TEST(redefinedAncestorsAreCalled)
+{
+    Machine machine;
+
+    /* `add' is inlined into `foo' until it is redefined */
+    evaluate(machine, "define(foo () add(1 2))");
+    assert(evaluate(machine, "foo()").integer() == 3);
+
+    evaluate(machine, "define(add () 42)");
+    assert(evaluate(machine, "foo()").integer() == 42);
+};
+
+TEST(peepholePreservesResults)
+{
+    Machine plain, optimized;
+    const char *program[] = {
+        "define(three () add(1 2))",
+        "define(seven () add(three() 4))",
+        "define(add () 42)",
+        "add(seven() three())",
+    };
+
+    for (auto source : program) {
+        Data a = evaluate(plain, source, false);
+        Data b = evaluate(optimized, source, true);
+        assert(a.toString() == b.toString());
+    }
+    assert(evaluate(optimized, "seven()").integer() == 42);
+};
+
+TEST(integersHaveSixtyThreeBits)
+{
+    Machine machine;
+    assert(evaluate(machine, "9223372036854775807").integer()
+            == Data::INTEGER_MAX);
+    assert(evaluate(machine, "add(9223372036854775807 2)").integer() == 1);
+
+    /* literals which don't fit are rejected rather than wrapped */
+    for (auto source : { "9223372036854775808", "18446744073709551615",
+            "18446744073709551616" }) {
+        fflush(stdout);
+        pid_t child = fork();
+        if (child == 0) {
+            signal(SIGABRT, SIG_DFL);
+            evaluate(machine, source);
+            _exit(0);
+        }
+        int status;
+        waitpid(child, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+    }
+};
+
+TEST(foldsAreUndoneByRedefinition)
+{
+    Machine machine;
+
+    /* `use' folds to 4 until `three' or `add' is redefined */
+    evaluate(machine, "define-pure(three () add(1 2))");
+    evaluate(machine, "define(use () add(three() 1))");
+    assert(evaluate(machine, "use()").integer() == 4);
+
+    evaluate(machine, "define-pure(three () 10)");
+    assert(evaluate(machine, "use()").integer() == 11);
+
+    evaluate(machine, "define(add () 7)");
+    assert(evaluate(machine, "use()").integer() == 7);
+
+    /* impure procedures are never folded */
+    evaluate(machine, "define-pure(loud () print(5))");
+    evaluate(machine, "define(quiet () loud())");
+    assert(evaluate(machine, "quiet()").integer() == 5);
+
+    /* evaluating a fold makes nothing hot */
+    Runtime runtime;
+    Machine tiered(false);
+    tiered.setTier(&runtime, 1);
+    evaluate(tiered, "define-pure(five () 5)");
+    evaluate(tiered, "define(use () five())");
+    assert(!tiered.promoted("five"));
+    assert(evaluate(tiered, "use()").integer() == 5);
+    assert(!tiered.promoted("five") && tiered.promoted("use"));
+};
+
+TEST(stacksGrowInPlace)
+{
+    Stack stack;
+    const uint64_t *limit = stack.limit();
+    for (unsigned long i = 0; i < 100000; i++)
+        stack.push(Data(i));
+    assert(stack.get(99999).integer() == 99999);
+    assert(stack.limit() == limit);
+
+    /* pushing past the end is a stack overflow rather than a crash */
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+        for (;;)
+            stack.push(Data(1UL));
+    int status;
+    waitpid(child, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+
+    /* faults outside every region are still faults */
+    child = fork();
+    if (child == 0)
+        *(volatile char*) NULL = 0;
+    waitpid(child, &status, 0);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+};
+
+TEST(deadCodeIsCompacted)
+{
+    Runtime runtime;
+    Machine machine;
+    machine.setVerbose(false);
+    machine.setTier(&runtime, 1);
+
+    evaluate(machine, "define(inc (a) add(a 1))");
+    evaluate(machine, "define(twice (x) add(inc(x) inc(x)))");
+    assert(evaluate(machine, "twice(1)").integer() == 4);
+    unsigned long size = machine.codeSize();
+
+    for (int i = 0; i < 10; i++)
+        evaluate(machine, "define(inc (a) add(a 2))");
+    assert(machine.codeSize() > size);
+    machine.compact();
+    assert(machine.codeSize() == size);
+    assert(evaluate(machine, "twice(1)").integer() == 6);
+
+    /* inlined ancestors are still patched where they moved to */
+    evaluate(machine, "define(add (a b) 5)");
+    assert(evaluate(machine, "inc(1)").integer() == 5);
+
+    /* a long session compacts by itself */
+    for (int i = 0; i < 5000; i++)
+        evaluate(machine, "define(inc (a) 7)");
+    assert(machine.codeSize() < size + 2 * CODE_GARBAGE);
+    assert(evaluate(machine, "twice(1)").integer() == 5);
+
+    /* so do the call sites of dead code */
+    evaluate(machine, "define(seven () 7)");
+    unsigned long sites = machine.siteCount();
+    for (int i = 0; i < 10; i++)
+        evaluate(machine, "define(inc (a) seven())");
+    assert(machine.siteCount() == sites + 10);
+    machine.compact();
+    assert(machine.siteCount() == sites + 1);
+    assert(evaluate(machine, "inc(1)").integer() == 7);
+};
+
+TEST(nativeCodeSurvivesRenumbering)
+{
+    Runtime runtime;
+    Machine machine(false);
+    machine.setTier(&runtime, 1);
+
+    /* the folds of `hot' and `last' move down over those of dead `junk' */
+    evaluate(machine, "define-pure(three () 3)");
+    for (int i = 0; i < 3; i++)
+        evaluate(machine, "define(junk () add(three() 1))");
+    evaluate(machine, "define(hot () add(three() 2))");
+    evaluate(machine, "define(other () add(three() 7))");
+    evaluate(machine, "define(last () add(three() 9))");
+    assert(evaluate(machine, "hot()").integer() == 5);
+    assert(machine.promoted("hot"));
+
+    machine.compact();
+    assert(evaluate(machine, "hot()").integer() == 5);
+    assert(machine.promoted("hot"));
+};
+
+TEST(tailCallsReuseFrames)
+{
+    Machine machine;
+
+    /* folding `spin' makes 100000 tail calls before the Machine gives up */
+    evaluate(machine, "define-pure(spin () spin())");
+    evaluate(machine, "define(use () spin())");
+
+    /* what is left in a frame is dropped, but the result is unchanged */
+    evaluate(machine, "define(two () 2)");
+    evaluate(machine, "define(g (a b) 1 two())");
+    evaluate(machine, "define(f () 5 6 g(3 4))");
+    assert(evaluate(machine, "add(f() f())").integer() == 4);
+    assert(evaluate(machine, "add(1 g(1 2))").integer() == 3);
+};
+
+TEST(verifiedCallersSurviveArityChanges)
+{
+    Machine machine;
+#ifdef SCRIBBLE_THREADED
+    machine.setDispatch(DISPATCH_THREADED);
+#endif
+
+    /* `use' is verified assuming `one' takes nothing and returns a value */
+    evaluate(machine, "define(one () 1)");
+    evaluate(machine, "define(use () 7 one() one())");
+    assert(evaluate(machine, "use()").integer() == 1);
+
+    evaluate(machine, "define(one (x) 3)");
+    assert(evaluate(machine, "use()").integer() == 3);
+    assert(evaluate(machine, "add(use() 1)").integer() == 4);
+};
+
+TEST(argumentsResolveToSlots)
+{
+    Machine machine;
+
+    evaluate(machine, "define(pick (a b c) add(c a))");
+    assert(evaluate(machine, "pick(1 2 3)").integer() == 4);
+
+    /* a pure procedure is folded with its arguments bound */
+    evaluate(machine, "define-pure(twice (x) add(x x))");
+    evaluate(machine, "define(use (y) add(twice(21) y))");
+    assert(evaluate(machine, "use(1)").integer() == 43);
+
+    /* names which aren't arguments are still symbols */
+    evaluate(machine, "define(name (a) b)");
+    assert(evaluate(machine, "name(1)").symbol() == "b");
+
+    /* every value naming `b' points at the one copy of it */
+    Atom b = Atoms::intern(std::string("b"));
+    assert(Primitive(PRM_SYMBOL, "b").atom() == b);
+    assert(&evaluate(machine, "name(2)").symbol() == &Atoms::name(b));
+    assert(&evaluate(machine, "\"b\"").string() == &Atoms::name(b));
+};
+
+TEST(hotProceduresArePromoted)
+{
+    Runtime runtime;
+    Machine machine;
+    machine.setTier(&runtime);
+
+    /* `h' calls `inc' a thousand times, which is enough to promote it */
+    evaluate(machine, "define(inc (a) add(a 1))");
+    evaluate(machine, "define(f (n) inc(inc(inc(inc(inc(inc(inc(inc(inc(inc(n)))))))))))");
+    evaluate(machine, "define(g (n) f(f(f(f(f(f(f(f(f(f(n)))))))))))");
+    evaluate(machine, "define(h (n) g(g(g(g(g(g(g(g(g(g(n)))))))))))");
+    assert(evaluate(machine, "h(0)").integer() == 1000);
+    assert(machine.promoted("inc"));
+    assert(!machine.promoted("h"));
+    assert(evaluate(machine, "h(5)").integer() == 1005);
+
+    /* a hot procedure is compiled again as soon as it is redefined */
+    evaluate(machine, "define(inc (a) add(a 2))");
+    assert(machine.promoted("inc"));
+    assert(evaluate(machine, "h(0)").integer() == 2000);
+
+    /* as does patching an inlined ancestor back into a call */
+    evaluate(machine, "define(add (a b) 5)");
+    assert(!machine.promoted("inc"));
+    assert(evaluate(machine, "inc(1)").integer() == 5);
+};
+
+/* A tier which counts what it compiles */
+class CountingTier : public NativeTier
+{
+public:
+    CountingTier (NativeTier& tier)
+        : tier(tier)
+    {}
+
+    NativeProcedure
+    compile (const std::string& symbol, const NativeBody& body)
+    {
+        compiled.push_back(symbol.substr(0, symbol.find('.')));
+        return tier.compile(symbol, body);
+    }
+
+    void
+    interpret (const std::string& symbol)
+    {
+        tier.interpret(symbol);
+    }
+
+    NativeTier& tier;
+    std::vector<std::string> compiled;
+};
+
+TEST(redefinitionSwapsNativeCode)
+{
+    Runtime runtime;
+    CountingTier tier(runtime);
+    Machine machine;
+    machine.setTier(&tier, 1);
+
+    evaluate(machine, "define(inc (a) add(a 1))");
+    evaluate(machine, "define(twice (x) add(inc(x) inc(x)))");
+    assert(evaluate(machine, "twice(1)").integer() == 4);
+    assert(tier.compiled.size() == 2);
+
+    /* `twice' calls the new `inc' without being compiled again */
+    evaluate(machine, "define(inc (a) add(a 5))");
+    assert(tier.compiled.size() == 3 && tier.compiled.back() == "inc");
+    assert(evaluate(machine, "twice(1)").integer() == 12);
+    assert(tier.compiled.size() == 3);
+
+    /* unless the callee no longer takes what its callers assumed it takes */
+    evaluate(machine, "define(one () 1)");
+    evaluate(machine, "define(use () 7 one() one())");
+    assert(evaluate(machine, "use()").integer() == 1);
+    assert(machine.promoted("use"));
+
+    evaluate(machine, "define(one (x) 3)");
+    assert(!machine.promoted("use"));
+    assert(evaluate(machine, "use()").integer() == 3);
+};
+
+TEST(hotCallsAreClustered)
+{
+    Runtime runtime;
+    Machine machine;
+    machine.setTier(&runtime, 1);
+
+    evaluate(machine, "define(inc (a) add(a 1))");
+    evaluate(machine, "define(twice (x) add(inc(x) inc(x)))");
+    assert(evaluate(machine, "twice(1)").integer() == 4);
+    runtime.settle();
+    assert(runtime.getClusters() == 1);
+    assert(evaluate(machine, "twice(1)").integer() == 4);
+
+    /* `twice' leaves the cluster with the old `inc' until it is merged again */
+    evaluate(machine, "define(inc (a) add(a 5))");
+    assert(evaluate(machine, "twice(1)").integer() == 12);
+    runtime.settle();
+    assert(runtime.getClusters() == 1);
+    assert(evaluate(machine, "twice(1)").integer() == 12);
+};
+
+TEST(programsAreBuiltAheadOfTime)
+{
+    Machine machine;
+    evaluate(machine, "define(inc (a) add(a 1))");
+    evaluate(machine, "define(twice (x) add(inc(x) inc(x)))");
+    evaluate(machine, "define(main () print(\"twice\") print(twice(20)))");
+
+    std::map<std::string, NativeBody> bodies;
+    std::string entry, failed;
+    assert(machine.program("main", bodies, entry, failed));
+    assert(bodies.size() == 3);
+
+    char path[] = "/tmp/scribble-build-XXXXXX";
+    close(mkstemp(path));
+    Runtime runtime;
+    assert(runtime.build(bodies, entry, path));
+
+    char output[64] = { 0 };
+    FILE *program = popen(path, "r");
+    fread(output, 1, sizeof(output) - 1, program);
+    assert(pclose(program) == 0);
+    assert(std::string(output) == "\"twice\"\n42\n");
+    unlink(path);
+};
+
+TEST(nativeCodeMatchesInterpreter)
+{
+    /*
+     * Recursing without end runs out of frames natively as it does
+     * interpreted, rather than out of C stack. The JIT's threads don't
+     * survive a fork, so each child has a Runtime of its own, made before
+     * the parent's as there may only be one at a time.
+     */
+    const unsigned long thresholds[] = { 0, TIER_THRESHOLD, 1 };
+    for (unsigned long threshold : thresholds) {
+        fflush(stdout);
+        pid_t child = fork();
+        if (child == 0) {
+            signal(SIGABRT, SIG_DFL);
+            Runtime own;
+            Machine machine;
+            if (threshold)
+                machine.setTier(&own, threshold);
+            evaluate(machine, "define(r (x) add(r(x) 1))");
+            evaluate(machine, "r(1)");
+            _exit(0);
+        }
+        int status;
+        waitpid(child, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+    }
+
+    Runtime runtime;
+    Machine plain, unoptimized, native, nativeUnoptimized;
+
+    /* promote everything on its first call */
+    native.setTier(&runtime, 1);
+    nativeUnoptimized.setTier(&runtime, 1);
+
+    const char *program[] = {
+        "define(inc (a) add(a 1))",
+        "inc(41)",
+        "define(pick (a b c) add(c a))",
+        "pick(1 2 3)",
+        "define(same (s) s)",
+        "same(\"hello\")",
+        "define(name (a) b)",
+        "name(1)",
+        "define(two () 2)",
+        "define(g (a b) 1 two())",
+        "define(f () 5 6 g(3 4))",
+        "f()",
+        "add(1 g(1 2))",
+        "define(twice (x) add(inc(x) inc(x)))",
+        "twice(3)",
+        "define-pure(three () add(1 2))",
+        "define(use (y) add(three() y))",
+        "use(4)",
+        "define-pure(three () 10)",
+        "use(4)",
+        "define(inc (a) add(a 2))",
+        "twice(3)",
+        "define(last (x) 7 inc(x))",
+        "last(41)",
+        "define(nothing () 1 two())",
+        "define(after () 9 nothing())",
+        "after()",
+    };
+
+    for (auto source : program) {
+        std::string expected = evaluate(plain, source).toString();
+        assert(evaluate(unoptimized, source, false).toString() == expected);
+        assert(evaluate(native, source).toString() == expected);
+        assert(evaluate(nativeUnoptimized, source, false).toString()
+                == expected);
+    }
+    assert(native.promoted("use"));
+    assert(nativeUnoptimized.promoted("pick"));
+
+    /* adding anything but integers fails natively as it does interpreted */
+    for (Machine *machine : { &plain, &native }) {
+        evaluate(*machine, "define(s (x) add(x x))");
+        assert(evaluate(*machine, "s(1)").integer() == 2);
+    }
+    assert(native.promoted("s"));
+    for (Machine *machine : { &plain, &native }) {
+        fflush(stdout);
+        pid_t child = fork();
+        if (child == 0) {
+            signal(SIGABRT, SIG_DFL);
+            evaluate(*machine, "s(\"a\")");
+            _exit(0);
+        }
+        int status;
+        waitpid(child, &status, 0);
+        assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
     }
-    assert(typestack.size() == 0);
 };
 
 END();